@@ -1,5 +1,6 @@
 #include "codec_params.h"
 
+#include <algorithm>
 #include <cmath>
 
 #include "platform.h"
@@ -36,6 +37,20 @@ void CodecParams::setPartitionCode(uint32_t code) {
   setPartitionParams(splitCode(code));
 }
 
+uint32_t CodecParams::stepPartitionCode(uint32_t code, uint32_t factor,
+                                        int32_t delta) {
+  static const uint32_t kRadix[kNumPartitionFactors] = {kMaxF1, kMaxF2, kMaxF3,
+                                                        kMaxF4};
+  Params params = splitCode(code);
+  int32_t digit = static_cast<int32_t>(params[factor]) + delta;
+  if (digit < 0 || digit >= static_cast<int32_t>(kRadix[factor])) {
+    return kInvalid;
+  }
+  params[factor] = static_cast<uint32_t>(digit);
+  return params[0] +
+         kMaxF1 * (params[1] + kMaxF2 * (params[2] + kMaxF3 * params[3]));
+}
+
 uint32_t CodecParams::getPartitionCode() const {
   return params[0] +
          kMaxF1 * (params[1] + kMaxF2 * (params[2] + kMaxF3 * params[3]));
@@ -97,4 +112,35 @@ uint32_t CodecParams::getLevel(const Vector<int32_t>& region) const {
   return kMaxLevel - 1;
 }
 
+CodecParams::PartitionSignature CodecParams::getPartitionSignature() const {
+  PartitionSignature result = PartitionSignature();
+  // Box is at least 1x1 and at most width x height.
+  uint32_t min_d = 2;
+  uint32_t max_d = width * width + height * height;
+  bool reachable[kMaxLevel] = {false};
+  uint32_t upper = max_d + 1;
+  for (uint32_t i = 0; i < kMaxLevel; ++i) {
+    uint32_t threshold = std::min(std::max(levelScale[i], min_d), max_d + 1);
+    // Level "i" gets [threshold, upper), where upper is the lowest of previous
+    // thresholds; otherwise threshold does not matter.
+    if (threshold < upper) {
+      reachable[i] = true;
+      result[i] = threshold;
+      upper = threshold;
+    }
+  }
+  // Boxes below all the thresholds get the last level.
+  if (upper > min_d) reachable[kMaxLevel - 1] = true;
+  for (uint32_t i = 0; i < kMaxLevel; ++i) {
+    result[kMaxLevel + i] = reachable[i] ? angle_bits[i] : 0;
+  }
+  // Distance range delta never exceeds the diagonal; see DistanceRange. Line
+  // quant does not depend on line limit if delta fits it.
+  uint32_t diagonal = static_cast<uint32_t>(std::sqrt(
+      static_cast<double>((width - 1) * (width - 1) +
+                          (height - 1) * (height - 1))));
+  result[2 * kMaxLevel] = std::min(line_limit, diagonal + 2);
+  return result;
+}
+
 }  // namespace twim
@@ -1,6 +1,7 @@
 #ifndef TWIM_CODEC_PARAMS
 #define TWIM_CODEC_PARAMS
 
+#include <array>
 #include <string>
 
 #include "platform.h"
@@ -80,6 +81,19 @@ class CodecParams {
   uint32_t angle_bits[kMaxLevel] = {0};
   static constexpr const uint32_t kMaxPartitionCode =
       kMaxF1 * kMaxF2 * kMaxF3 * kMaxF4;
+
+  /* Level thresholds clamped to the range of possible box sizes, angle bits
+     of reachable levels and line limit clamped to the image diagonal.
+     Partitions built with the same signature are the same. */
+  using PartitionSignature = std::array<uint32_t, 2 * kMaxLevel + 1>;
+  PartitionSignature getPartitionSignature() const;
+
+  /* Partition code is a mixed radix number of kNumPartitionFactors digits. */
+  static constexpr const uint32_t kNumPartitionFactors = 4;
+  /* Returns code with |factor|-th digit changed by |delta|, or kInvalid if
+     the digit goes out of range. */
+  static uint32_t stepPartitionCode(uint32_t code, uint32_t factor,
+                                    int32_t delta);
 };
 
 }  // namespace twim
@@ -1,6 +1,9 @@
 #include "codec_params.h"
 
+#include <set>
+
 #include "gtest/gtest.h"
+#include "platform.h"
 #include "xrange_encoder.h"
 
 namespace twim {
@@ -48,4 +51,67 @@ TEST(CodecParamsTest, ImageTax) {
   EXPECT_EQ(XRangeEncoderFriend::estimateEntropy(&dst),
             calculateImageTax(8, 8));
 }
+
+TEST(CodecParamsTest, PartitionSignatureMatchesLevels) {
+  constexpr int32_t kWidth = 9;
+  constexpr int32_t kHeight = 11;
+  std::set<CodecParams::PartitionSignature> distinct;
+  CodecParams a(kWidth, kHeight);
+  CodecParams b(kWidth, kHeight);
+  // Box corners are enough for the level: top and bottom rows of the box.
+  Vector<int32_t>* box = allocVector<int32_t>(3 * vecSize(2));
+  const size_t step = box->capacity / 3;
+  int32_t* RESTRICT y = box->data();
+  int32_t* RESTRICT x0 = y + step;
+  int32_t* RESTRICT x1 = x0 + step;
+  box->len = 2;
+  y[0] = 0;
+  x0[0] = x0[1] = 0;
+  for (uint32_t i = 0; i < CodecParams::kMaxPartitionCode; ++i) {
+    a.setPartitionCode(i);
+    distinct.insert(a.getPartitionSignature());
+    for (uint32_t j = 0; j < i; ++j) {
+      b.setPartitionCode(j);
+      if (a.getPartitionSignature() != b.getPartitionSignature()) continue;
+      for (y[1] = 0; y[1] < kHeight; ++y[1]) {
+        for (x1[0] = 1; x1[0] <= kWidth; ++x1[0]) {
+          x1[1] = x1[0];
+          uint32_t level = a.getLevel(*box);
+          ASSERT_EQ(level, b.getLevel(*box));
+          ASSERT_EQ(a.angle_bits[level], b.angle_bits[level]);
+        }
+      }
+    }
+  }
+  delete box;
+  EXPECT_GT(static_cast<size_t>(CodecParams::kMaxPartitionCode),
+            distinct.size());
+
+  // Line limit does not matter once it exceeds the diagonal.
+  a.line_limit = 15;
+  b.setPartitionCode(CodecParams::kMaxPartitionCode - 1);
+  b.line_limit = CodecParams::kMaxLineLimit;
+  EXPECT_EQ(a.getPartitionSignature(), b.getPartitionSignature());
+  a.line_limit = 10;
+  EXPECT_NE(a.getPartitionSignature(), b.getPartitionSignature());
+}
+
+TEST(CodecParamsTest, StepPartitionCode) {
+  size_t numNeighbours = 0;
+  for (uint32_t code = 0; code < CodecParams::kMaxPartitionCode; ++code) {
+    for (uint32_t f = 0; f < CodecParams::kNumPartitionFactors; ++f) {
+      for (int32_t delta = -1; delta <= 1; delta += 2) {
+        uint32_t next = CodecParams::stepPartitionCode(code, f, delta);
+        if (next == CodecParams::kInvalid) continue;
+        numNeighbours++;
+        ASSERT_GT(static_cast<uint32_t>(CodecParams::kMaxPartitionCode),
+                  next);
+        ASSERT_EQ(code, CodecParams::stepPartitionCode(next, f, -delta));
+      }
+    }
+  }
+  // Factor ranges are 4, 5, 5, 5: each has (range - 1) * 2 neighbour pairs
+  // per combination of other factors.
+  EXPECT_EQ(2u * (3 * 125 + 4 * 100 + 4 * 100 + 4 * 100), numNeighbours);
+}
 }  // namespace twim
@@ -2,15 +2,26 @@
 
 #include "encoder.h"
 
+#include <algorithm>
+#include <chrono>
 #if !defined(__wasm__)
-#include <future>
+#include <condition_variable>
 #endif
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #include "codec_params.h"
+#include "distance_range.h"
 #include "encoder_internal.h"
 #include "encoder_simd.h"
 #include "image.h"
 #include "platform.h"
+#include "region.h"
+#include "sin_cos.h"
+#include "thread_pool.h"
 #include "xrange_encoder.h"
 
 namespace twim {
@@ -61,15 +72,17 @@ float calculateImageTax(uint32_t width, uint32_t height) {
   return kFlatTax + simulateWriteSize(width) + simulateWriteSize(height);
 }
 
-UberCache::UberCache(const Image& src)
+UberCache::UberCache(const Image& src, uint32_t shearTableBits)
     : width(src.width),
       height(src.height),
       // 4 == [r, g, b, count].length
       stride(vecSize(4 * (src.width + 1))),
       sum(allocVector<int32_t>(stride * src.height)),
+      sum2(allocVector<int32_t>(stride * src.height)),
       imageTax(calculateImageTax(src.width, src.height)) {
   int32_t* RESTRICT sum = this->sum->data();
-  float sum2 = 0.0f;
+  int32_t* RESTRICT sum2 = this->sum2->data();
+  float sqe = 0.0f;
   for (size_t y = 0; y < src.height; ++y) {
     float row_rgb2[3] = {0.0f};
     size_t src_row_offset = y * src.width;
@@ -78,6 +91,7 @@ UberCache::UberCache(const Image& src)
     const uint8_t* RESTRICT b_row = src.b + src_row_offset;
     size_t dstRowOffset = y * this->stride;
     for (size_t i = 0; i < 4; ++i) sum[dstRowOffset + i] = 0.0f;
+    for (size_t i = 0; i < 4; ++i) sum2[dstRowOffset + i] = 0;
     for (size_t x = 0; x < src.width; ++x) {
       size_t dstOffset = dstRowOffset + 4 * x;
       int32_t r = r_row[x];
@@ -87,13 +101,67 @@ UberCache::UberCache(const Image& src)
       sum[dstOffset + 5] = sum[dstOffset + 1] + g;
       sum[dstOffset + 6] = sum[dstOffset + 2] + b;
       sum[dstOffset + 7] = sum[dstOffset + 3] + 1;
+      sum2[dstOffset + 4] = sum2[dstOffset + 0] + r * r;
+      sum2[dstOffset + 5] = sum2[dstOffset + 1] + g * g;
+      sum2[dstOffset + 6] = sum2[dstOffset + 2] + b * b;
+      sum2[dstOffset + 7] = 0;
       row_rgb2[0] += r * r;
       row_rgb2[1] += g * g;
       row_rgb2[2] += b * b;
     }
-    for (size_t c = 0; c < 3; ++c) sum2 += row_rgb2[c];
+    for (size_t c = 0; c < 3; ++c) sqe += row_rgb2[c];
+  }
+  this->sqeBase = sqe;
+
+  if (shearTableBits == 0) return;
+  if (shearTableBits > SinCos.kMaxAngleBits) {
+    shearTableBits = SinCos.kMaxAngleBits;
+  }
+  // Tables are too wide for near-horizontal lines; those are cheap anyway.
+  int32_t angle_step = SinCos.kMaxAngle >> shearTableBits;
+  for (int32_t angle = 0; angle < SinCos.kMaxAngle; angle += angle_step) {
+    if (4 * angle < SinCos.kMaxAngle || 4 * angle > 3 * SinCos.kMaxAngle) {
+      continue;
+    }
+    shear[angle] = new ShearTable(*this, angle);
+  }
+}
+
+ShearTable::ShearTable(const UberCache& uber, int32_t angle)
+    : shift(allocVector<int32_t>(uber.height)) {
+  const uint32_t width = uber.width;
+  const uint32_t height = uber.height;
+  int32_t* RESTRICT shift = this->shift->data();
+  // x = d / nx + 0.5 - y * ny / nx ~ c + round(-y * ny / nx)
+  double m_ny_nx = SinCos.kMinusCot[angle];
+  int32_t min_shift = 0;
+  int32_t max_shift = 0;
+  for (uint32_t y = 0; y < height; ++y) {
+    shift[y] = static_cast<int32_t>(std::floor(y * m_ny_nx + 0.5));
+    min_shift = std::min(min_shift, shift[y]);
+    max_shift = std::max(max_shift, shift[y]);
+  }
+  c_min = -max_shift;
+  c_count = static_cast<uint32_t>(width - min_shift - c_min + 1);
+  // 4 == [r, g, b, count].length
+  stride = vecSize(4 * c_count);
+  sum = allocVector<int32_t>(stride * (height + 1));
+
+  const int32_t* RESTRICT src = uber.sum->data();
+  int32_t* RESTRICT dst = sum->data();
+  for (size_t i = 0; i < stride; ++i) dst[i] = 0;
+  for (uint32_t y = 0; y < height; ++y) {
+    const int32_t* RESTRICT src_row = src + y * uber.stride;
+    const int32_t* RESTRICT prev_row = dst + y * stride;
+    int32_t* RESTRICT row = dst + (y + 1) * stride;
+    int32_t x = c_min + shift[y];
+    for (uint32_t c = 0; c < c_count; ++c, ++x) {
+      int32_t clamped_x = std::min<int32_t>(width, std::max(0, x));
+      for (size_t i = 0; i < 4; ++i) {
+        row[4 * c + i] = prev_row[4 * c + i] + src_row[4 * clamped_x + i];
+      }
+    }
   }
-  this->sqeBase = sum2;
 }
 
 Cache::Cache(const UberCache& uber)
@@ -102,9 +170,314 @@ Cache::Cache(const UberCache& uber)
       y(allocVector<float>(uber.height)),
       x0(allocVector<int32_t>(uber.height)),
       x1(allocVector<int32_t>(uber.height)),
-      x(allocVector<int32_t>(uber.height)),
-      stats(allocVector<float>(
-          6 * vecSize(CodecParams::kMaxLineLimit * SinCos.kMaxAngle))) {}
+      sweep_next(allocVector<int32_t>(2 * vecSize(uber.height))),
+      sweep_head(allocVector<int32_t>(2 * vecSize(CodecParams::kMaxLineLimit))),
+      sweep_slot(allocVector<int32_t>(2 * vecSize(uber.height))),
+      stats(allocVector<float>(6 * vecSize(kStatsWindow))),
+      approx_region((uber.approxRowStride > 1)
+                        ? allocVector<int32_t>(3 * vecSize(uber.height))
+                        : nullptr),
+      approx_candidates((uber.approxRowStride > 1)
+                            ? new Array<SplitCandidate>(2 * uber.approxTopK)
+                            : nullptr),
+      coarse_seeds((uber.coarseSeeds > 0)
+                       ? new Array<SplitCandidate>(2 * uber.coarseSeeds)
+                       : nullptr),
+      split_left(allocVector<int32_t>(3 * vecSize(uber.height))),
+      split_right(allocVector<int32_t>(3 * vecSize(uber.height))) {}
+
+#if !defined(__wasm__)
+/*
+ * Searches subdivisions of the queued fragments ahead of buildPartition.
+ *
+ * Search result depends only on the fragment region, level and parameters,
+ * so it is the same no matter which thread finds it. buildPartition still
+ * pops fragments in the same order and takes the results in that order;
+ * thus the partition is the same as if there were no pool. Fragments that
+ * are never popped waste some work.
+ *
+ * Large fragments are not searched ahead; instead, their angles are split
+ * between the workers and the thread that needs the result.
+ *
+ * Workers are jobs of the shared thread pool. A worker does one search (or
+ * angle share) and re-queues itself while there is more to do, so it never
+ * holds a pool thread waiting for work. Caches and scratch fragments are
+ * reused by the following workers.
+ */
+class SearchPool {
+ public:
+  SearchPool(const UberCache& uber, const CodecParams& cp, uint32_t numWorkers)
+      : uber(&uber), cp(cp), numWorkers(numWorkers), workers(uber.pool) {}
+
+  ~SearchPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    workers.wait();
+    // The rest of queued jobs are owned by |jobs|.
+    for (Job* job : pending) {
+      if (job->state == Job::kCancelled) delete job;
+    }
+    for (Scratch* scratch : scratches) delete scratch;
+  }
+
+  /* Queues measured, but not yet searched fragment; |f| should not move. */
+  void submit(Fragment* f) {
+    if (isLarge(*f)) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    Job* job = new Job();
+    job->fragment = f;
+    job->bound = f->best_score;
+    job->seq = nextSeq++;
+    jobs[f].reset(job);
+    pending.push_back(job);
+    std::push_heap(pending.begin(), pending.end(), Job::later);
+    startWorkers();
+  }
+
+  /*
+   * Fills subdivision search result; if |f| was not submitted, or no worker
+   * has started it yet, it is searched by the calling thread.
+   */
+  void find(Fragment* f, Cache* cache) {
+    std::unique_ptr<Job> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      auto it = jobs.find(f);
+      if (it != jobs.end()) {
+        job = std::move(it->second);
+        jobs.erase(it);
+        if (job->state == Job::kQueued) {
+          // Stays in |pending|; workers discard it.
+          job->state = Job::kCancelled;
+          job.release();
+        } else {
+          finished.wait(lock, [&job] { return job->state == Job::kDone; });
+        }
+      }
+    }
+    if (!job) {
+      search(f, cache);
+      return;
+    }
+    f->loadSearch(job->result);
+    cache->approx_searches += job->approxSearches;
+    cache->approx_mismatches += job->approxMismatches;
+  }
+
+ private:
+  struct Job {
+    enum State { kQueued, kRunning, kDone, kCancelled };
+    Fragment* fragment;
+    /* Upper bound of the score; better fragments are searched first. */
+    float bound;
+    uint64_t seq;
+    State state = kQueued;
+    SubdivisionResult result;
+    uint64_t approxSearches = 0;
+    uint64_t approxMismatches = 0;
+
+    /* Heap order: the best bound, then the earliest. */
+    static bool later(const Job* a, const Job* b) {
+      if (a->bound != b->bound) return a->bound < b->bound;
+      return a->seq > b->seq;
+    }
+  };
+
+  /* What a worker needs to search; stand-in fragment shares the region of
+     the queued one. */
+  struct Scratch {
+    explicit Scratch(const UberCache& uber) : cache(uber) {
+      fragment = new (&arena) Fragment(&arena, 1);
+    }
+
+    Cache cache;
+    Arena arena;
+    Fragment* fragment;
+  };
+
+  /*
+   * Exact search is split by angles; approximate and coarse-to-fine searches
+   * pick candidates globally and are always done by a single thread.
+   */
+  bool isLarge(const Fragment& f) const {
+    return (uber->parallelSearchRows > 0) &&
+           (f.region->len >= uber->parallelSearchRows) &&
+           (uber->approxRowStride == 1) && (uber->coarseSeeds == 0);
+  }
+
+  /* Queues more workers, if there is work for them; called with the lock. */
+  void startWorkers() {
+    while (numActive < numWorkers && numActive < numItems()) {
+      numActive++;
+      workers.spawn([this] { work(); });
+    }
+  }
+
+  /* Angle shares and queued jobs left; some jobs could be cancelled. */
+  size_t numItems() const { return (numShares - nextShare) + pending.size(); }
+
+  /* Searches |f| in the calling thread, helped by the workers if large. */
+  void search(Fragment* f, Cache* cache) {
+    if (!isLarge(*f)) {
+      findBestSubdivision(f, cache, cp);
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    sweep = f;
+    numShares = numWorkers + 1;
+    nextShare = 0;
+    doneShares = 0;
+    shareFound.assign(numShares, 0);
+    shareBest.resize(numShares);
+    startWorkers();
+    while (nextShare < numShares) {
+      uint32_t share = nextShare++;
+      lock.unlock();
+      searchShare(share, cache);
+      lock.lock();
+    }
+    finished.wait(lock, [this] { return doneShares == numShares; });
+    sweep = nullptr;
+    numShares = 0;
+    nextShare = 0;
+    lock.unlock();
+
+    // Shares are merged as if candidates were evaluated in a single pass:
+    // the best score wins; ties are resolved by the evaluation order.
+    uint32_t angle_max = 1u << cp.angle_bits[f->level];
+    auto order = [angle_max](uint32_t code) {
+      return (code % angle_max) * 64 + code / angle_max;
+    };
+    bool found = false;
+    SplitCandidate best = {0.0f, 0};
+    for (size_t i = 0; i < shareFound.size(); ++i) {
+      if (!shareFound[i]) continue;
+      const SplitCandidate& candidate = shareBest[i];
+      if (!found || candidate.score > best.score ||
+          (candidate.score == best.score &&
+           order(candidate.code) < order(best.code))) {
+        found = true;
+        best = candidate;
+      }
+    }
+    applySubdivision(f, cache, cp, found, best);
+  }
+
+  /* Searches the |share| of angles of |sweep|; called without the lock. */
+  void searchShare(uint32_t share, Cache* cache) {
+    SplitCandidate best;
+    bool found = searchAngleShare(sweep, cache, cp, share, numShares, &best);
+    std::lock_guard<std::mutex> lock(mutex);
+    shareFound[share] = found ? 1 : 0;
+    shareBest[share] = best;
+    if (++doneShares == numShares) finished.notify_all();
+  }
+
+  /* Does one angle share or one queued search, then re-queues itself. */
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (stop || numItems() == 0) {
+      numActive--;
+      return;
+    }
+    Scratch* scratch;
+    if (scratches.empty()) {
+      lock.unlock();
+      scratch = new Scratch(*uber);
+      lock.lock();
+    } else {
+      scratch = scratches.back();
+      scratches.pop_back();
+    }
+    if (nextShare < numShares) {
+      uint32_t share = nextShare++;
+      lock.unlock();
+      searchShare(share, &scratch->cache);
+      lock.lock();
+    } else {
+      Job* job = takeJob();
+      if (job) run(job, scratch, &lock);
+    }
+    scratches.push_back(scratch);
+    if (stop || numItems() == 0) {
+      numActive--;
+      return;
+    }
+    workers.spawn([this] { work(); });
+  }
+
+  /* Pops the best queued job, dropping cancelled ones; called with the
+     lock. */
+  Job* takeJob() {
+    while (!pending.empty()) {
+      std::pop_heap(pending.begin(), pending.end(), Job::later);
+      Job* job = pending.back();
+      pending.pop_back();
+      if (job->state != Job::kCancelled) return job;
+      delete job;
+    }
+    return nullptr;
+  }
+
+  /* Searches the queued |job|; called with the lock, which is released for
+     the search. */
+  void run(Job* job, Scratch* scratch, std::unique_lock<std::mutex>* lock) {
+    job->state = Job::kRunning;
+    const Fragment* f = job->fragment;
+    Fragment* stand_in = scratch->fragment;
+    stand_in->region = f->region;
+    stand_in->level = f->level;
+    for (size_t i = 0; i < 4; ++i) stand_in->stats[i] = f->stats[i];
+    stand_in->shared_key = f->shared_key;
+    lock->unlock();
+
+    Cache& cache = scratch->cache;
+    uint64_t approxSearches = cache.approx_searches;
+    uint64_t approxMismatches = cache.approx_mismatches;
+    SubdivisionCache* shared = uber->shared;
+    if (!shared || !shared->find(cp, stand_in)) {
+      findBestSubdivision(stand_in, &cache, cp);
+    }
+    stand_in->saveSearch(&job->result);
+    job->approxSearches = cache.approx_searches - approxSearches;
+    job->approxMismatches = cache.approx_mismatches - approxMismatches;
+
+    lock->lock();
+    job->state = Job::kDone;
+    finished.notify_all();
+  }
+
+  const UberCache* uber;
+  const CodecParams cp;
+  std::mutex mutex;
+  std::condition_variable finished;
+  bool stop = false;
+  uint64_t nextSeq = 0;
+  /* Angle shares of the large fragment being searched; |sweep|,
+     |numShares| and the search parameters do not change until all the
+     shares are done. */
+  const Fragment* sweep = nullptr;
+  uint32_t numShares = 0;
+  uint32_t nextShare = 0;
+  uint32_t doneShares = 0;
+  std::vector<uint8_t> shareFound;
+  std::vector<SplitCandidate> shareBest;
+  /* Heap of queued jobs; see Job::later. */
+  std::vector<Job*> pending;
+  /* Submitted jobs that are not taken yet; cancelled ones are owned by
+     |pending|. */
+  std::unordered_map<Fragment*, std::unique_ptr<Job>> jobs;
+  const uint32_t numWorkers;
+  /* Workers that are queued or running. */
+  uint32_t numActive = 0;
+  /* Released by the finished workers. */
+  std::vector<Scratch*> scratches;
+  /* Workers that have not started when the pool stops just quit. */
+  TaskGroup workers;
+};
+#endif
 
 class SimulationTask {
  public:
@@ -114,74 +487,709 @@ class SimulationTask {
   float bestSqe = 1e35f;
   uint32_t bestColorCode = (uint32_t)-1;
   Partition* partitionHolder = nullptr;
+  /* Palette (empty if colors are quantized) of the best color code. */
+  Vector<float>* bestPalette = nullptr;
   float imageTax;
+  bool warmPalettes;
+  /* Partition is built and color codes are evaluated by that many threads. */
+  uint32_t numThreads = 1;
 
   SimulationTask(uint32_t targetSize, Variant variant, const UberCache& uber)
       : targetSize(targetSize),
         variant(variant),
         cp(uber.width, uber.height),
-        imageTax(uber.imageTax) {}
-
-  ~SimulationTask() { delete partitionHolder; }
-
-  void run(Cache* cache) {
+        imageTax(uber.imageTax),
+        warmPalettes(uber.warmPalettes) {
     cp.setPartitionCode(variant.partitionCode);
     cp.line_limit = variant.lineLimit + 1;
+  }
+
+  ~SimulationTask() {
+    delete partitionHolder;
+    delete bestPalette;
+  }
+
+  void run(Cache* cache, Arena* arena) {
     uint64_t colorOptions = variant.colorOptions;
     // TODO: color-options based taxes
-    partitionHolder = new Partition(cache, cp, targetSize);
+#if defined(__wasm__)
+    partitionHolder = new Partition(arena, cache, cp, targetSize);
+#else
+    {
+      // Tiled partition uses spare threads on its own.
+      std::unique_ptr<SearchPool> pool;
+      if (numThreads > 1 && cache->uber->tilingLevels == 0) {
+        pool.reset(new SearchPool(*cache->uber, cp, numThreads - 1));
+      }
+      partitionHolder = new Partition(arena, cache, cp, targetSize,
+                                      pool.get(), numThreads);
+    }
+#endif
     float imageTax = cache->uber->imageTax;
+    // Patches of all the color codes are picked from the same children.
+    std::vector<uint32_t> codes;
+    std::vector<uint32_t> numNonLeaf;
+    uint32_t maxNonLeaf = 0;
     for (uint32_t colorCode = 0; colorCode < CodecParams::kMaxColorCode;
          ++colorCode) {
       if (!(colorOptions & ((uint64_t)1 << colorCode))) continue;
       cp.setColorCode(colorCode);
-      float sqe = simulateEncode(imageTax, *partitionHolder, targetSize, cp);
-      if (sqe < bestSqe) {
-        bestSqe = sqe;
-        bestColorCode = colorCode;
+      uint32_t count = partitionHolder->subpartition(imageTax, cp, targetSize);
+      // Let's deal with a flat image separately.
+      if (count <= 1) continue;
+      codes.push_back(colorCode);
+      numNonLeaf.push_back(count);
+      maxNonLeaf = std::max(maxNonLeaf, count);
+    }
+    if (codes.empty()) return;
+    Vector<float>* children =
+        gatherChildren(partitionHolder->getPartition(), maxNonLeaf);
+    std::vector<float> sqe(codes.size());
+    std::vector<Vector<float>*> palettes(codes.size());
+    Evaluation evaluation = {&codes, &numNonLeaf, maxNonLeaf, children,
+                             sqe.data(), palettes.data()};
+    // Warm palettes are built one after another.
+    uint32_t numColorThreads = warmPalettes ? 1 : numThreads;
+    numColorThreads = std::min<size_t>(numColorThreads, codes.size());
+#if defined(__wasm__)
+    numColorThreads = 1;
+#endif
+    if (numColorThreads <= 1) {
+      evaluate(&evaluation, 0, 1);
+    } else {
+#if !defined(__wasm__)
+      TaskGroup group(cache->uber->pool);
+      for (uint32_t i = 0; i < numColorThreads; ++i) {
+        group.spawn([this, &evaluation, i, numColorThreads] {
+          evaluate(&evaluation, i, numColorThreads);
+        });
+      }
+      group.wait();
+#endif
+    }
+    delete children;
+    // The first of the best color codes wins, as if evaluated in order.
+    for (size_t k = 0; k < codes.size(); ++k) {
+      if (sqe[k] < bestSqe) {
+        bestSqe = sqe[k];
+        bestColorCode = codes[k];
+        std::swap(bestPalette, palettes[k]);
       }
+      delete palettes[k];
     }
   }
+
+ private:
+  /* Color codes to evaluate and their results. */
+  struct Evaluation {
+    const std::vector<uint32_t>* codes;
+    const std::vector<uint32_t>* numNonLeaf;
+    uint32_t maxNonLeaf;
+    const Vector<float>* children;
+    float* sqe;
+    Vector<float>** palettes;
+  };
+
+  /* Evaluates each |stride|-th color code, starting with |first|. */
+  void evaluate(Evaluation* evaluation, size_t first, size_t stride) const {
+    const std::vector<uint32_t>& codes = *evaluation->codes;
+    CodecParams colorCp = cp;
+    Vector<float>* patches =
+        allocVector<float>(7 * vecSize(evaluation->maxNonLeaf + 1));
+    // The last built palette; seeds the next (bigger) one.
+    const Vector<float>* seed = nullptr;
+    for (size_t k = first; k < codes.size(); k += stride) {
+      colorCp.setColorCode(codes[k]);
+      selectPatches(evaluation->children, (*evaluation->numNonLeaf)[k],
+                    patches);
+      Vector<float>* palette = buildPalette(patches, colorCp.palette_size,
+                                            warmPalettes ? seed : nullptr);
+      evaluation->sqe[k] = simulateEncode(patches, palette, colorCp);
+      evaluation->palettes[k] = palette;
+      if (colorCp.palette_size > 0) seed = palette;
+    }
+    delete patches;
+  }
+};
+
+/*
+ * Tasks of a worker: a contiguous range of the task list. The owner takes
+ * tasks from the front; idle workers steal them from the back, away from the
+ * owner's current task.
+ */
+struct WorkerQueue {
+  std::mutex mutex;
+  size_t begin = 0;
+  size_t end = 0;
+  /* Tasks of the worker (own or stolen) are run by that many threads. */
+  uint32_t numTaskThreads = 1;
+  size_t numStolen = 0;
+  double busySeconds = 0.0;
 };
 
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start).count();
+}
+
 class TaskExecutor {
  public:
   explicit TaskExecutor(const UberCache& uber, size_t maxTasks)
       : uber(&uber), tasks(maxTasks) {}
 
-  void run() {
+  ~TaskExecutor() {
+    for (size_t i = 0; i < tasks.size; ++i) tasks.data[i].~SimulationTask();
+  }
+
+  /*
+   * Simulates all the |variants|. Variants with the same partition signature
+   * and color options give the same result; only the first of them is
+   * simulated.
+   */
+  void simulate(const Variant* variants, size_t numVariants,
+                uint32_t targetSize, uint32_t numThreads);
+
+  /* Simulation of the |i|-th variant; partition is absent if it failed. */
+  const SimulationTask& variantTask(size_t i) const {
+    return tasks.data[variantTasks[i]];
+  }
+
+  /* What a worker keeps between its tasks. */
+  struct WorkerState {
+    explicit WorkerState(const UberCache& uber) : cache(uber) {}
+    ~WorkerState() { delete arena; }
+
+    Cache cache;
+    // Memory of discarded partition is reused by the next one.
+    Arena* arena = nullptr;
     float bestSqe = 1e35f;
-    size_t lastBestTask = (size_t)-1;
-    Cache cache(*uber);
+    size_t lastBestTask = kNone;
+  };
+
+  void run(size_t worker) {
+    WorkerState state(*uber);
+    auto start = std::chrono::steady_clock::now();
+    while (step(worker, &state)) {
+    }
+    queues[worker].busySeconds = secondsSince(start);
+    finish(&state);
+  }
+
+#if !defined(__wasm__)
+  /*
+   * Runs a task of the |worker|, then queues the next one to the back of the
+   * |group|; other groups of the pool get a turn in between.
+   */
+  void runStep(TaskGroup* group, size_t worker, WorkerState* state) {
+    auto start = std::chrono::steady_clock::now();
+    bool more = step(worker, state);
+    queues[worker].busySeconds += secondsSince(start);
+    if (more) {
+      group->spawn([this, group, worker, state] {
+        runStep(group, worker, state);
+      });
+    }
+  }
+#endif
 
+  /* Runs the next task of the |worker|; returns false if there was none. */
+  bool step(size_t worker, WorkerState* state) {
+    size_t myTask = takeTask(worker);
+    if (myTask == kNone) return false;
+    SimulationTask& task = tasks.data[myTask];
+    Arena* arena = state->arena ? state->arena : new Arena();
+    state->arena = nullptr;
+    task.numThreads = queues[worker].numTaskThreads;
+    task.run(&state->cache, arena);
+    // Tasks could be stolen out of order; the earlier of equally good tasks
+    // is kept, as if tasks were run in order.
+    if (task.bestSqe < state->bestSqe ||
+        (task.bestSqe == state->bestSqe && myTask < state->lastBestTask)) {
+      state->bestSqe = task.bestSqe;
+      if (state->lastBestTask != kNone) {
+        state->arena = recycle(&tasks.data[state->lastBestTask]);
+      }
+      state->lastBestTask = myTask;
+    } else {
+      state->arena = recycle(&task);
+    }
+    return true;
+  }
+
+  void finish(WorkerState* state) {
+    approxSearches += state->cache.approx_searches;
+    approxMismatches += state->cache.approx_mismatches;
+  }
+
+  /*
+   * Returns the next task of the |worker|, or steals one; kNone if none, or
+   * if the encoding is cancelled.
+   */
+  size_t takeTask(size_t worker) {
+    if (uber->isCancelled()) return kNone;
+    WorkerQueue& own = queues[worker];
+    {
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (own.begin < own.end) return own.begin++;
+    }
     while (true) {
-      size_t myTask = nextTask++;
-      if (myTask >= tasks.size) return;
-      SimulationTask& task = tasks.data[myTask];
-      task.run(&cache);
-      if (task.bestSqe < bestSqe) {
-        bestSqe = task.bestSqe;
-        if (lastBestTask < myTask) {
-          delete tasks.data[lastBestTask].partitionHolder;
-          tasks.data[lastBestTask].partitionHolder = nullptr;
+      // The worker with the most tasks left is the victim.
+      size_t victim = kNone;
+      size_t most = 0;
+      for (size_t i = 0; i < queues.size(); ++i) {
+        std::lock_guard<std::mutex> lock(queues[i].mutex);
+        size_t left = queues[i].end - queues[i].begin;
+        if (left > most) {
+          victim = i;
+          most = left;
         }
-        lastBestTask = myTask;
-      } else {
-        delete task.partitionHolder;
-        task.partitionHolder = nullptr;
+      }
+      if (victim == kNone) return kNone;
+      std::lock_guard<std::mutex> lock(queues[victim].mutex);
+      if (queues[victim].begin < queues[victim].end) {
+        own.numStolen++;
+        return --queues[victim].end;
       }
     }
   }
 
+  static Arena* recycle(SimulationTask* task) {
+    Arena* arena = task->partitionHolder->releaseArena();
+    delete task->partitionHolder;
+    task->partitionHolder = nullptr;
+    arena->reset();
+    return arena;
+  }
+
+  static constexpr size_t kNone = (size_t)-1;
+
   const UberCache* uber;
 #if defined(__wasm__)
-  size_t nextTask = 0;
+  uint64_t approxSearches = 0;
+  uint64_t approxMismatches = 0;
 #else
-  std::atomic<size_t> nextTask{0};
+  std::atomic<uint64_t> approxSearches{0};
+  std::atomic<uint64_t> approxMismatches{0};
 #endif
   Array<SimulationTask> tasks;
+  std::vector<size_t> variantTasks;
+  std::vector<WorkerQueue> queues;
+  /* Time since the start of simulation until all workers are done. */
+  double wallSeconds = 0.0;
+};
+
+void TaskExecutor::simulate(const Variant* variants, size_t numVariants,
+                            uint32_t targetSize, uint32_t numThreads) {
+  variantTasks.resize(numVariants);
+  {
+    using Signature = std::pair<CodecParams::PartitionSignature, uint64_t>;
+    std::map<Signature, size_t> knownSignatures;
+    CodecParams cp(uber->width, uber->height);
+    for (size_t i = 0; i < numVariants; ++i) {
+      cp.setPartitionCode(variants[i].partitionCode);
+      cp.line_limit = variants[i].lineLimit + 1;
+      Signature signature(cp.getPartitionSignature(),
+                          variants[i].colorOptions);
+      auto it = knownSignatures.find(signature);
+      if (it == knownSignatures.end()) {
+        it = knownSignatures.emplace(signature, tasks.size++).first;
+        new (tasks.data + it->second)
+            SimulationTask(targetSize, variants[i], *uber);
+      }
+      variantTasks[i] = it->second;
+    }
+  }
+  auto start = std::chrono::steady_clock::now();
+#if defined(__wasm__)
+  numThreads = 1;
+#endif
+  // Threads beyond one per task search partition ahead and evaluate color
+  // codes; each worker gets its share of them.
+  uint32_t numTotalThreads = std::max<uint32_t>(1, numThreads);
+  numThreads = std::max<size_t>(1, std::min<size_t>(numThreads, tasks.size));
+  queues = std::vector<WorkerQueue>(numThreads);
+  for (uint32_t i = 0; i < numThreads; ++i) {
+    queues[i].numTaskThreads = numTotalThreads / numThreads +
+                               ((i < numTotalThreads % numThreads) ? 1 : 0);
+  }
+  // Each worker starts with a range of about the same number of tasks.
+  size_t first = 0;
+  uint32_t numFixed = 0;
+  if (uber->firstWorkerTasks > 0 && numThreads > 1) {
+    first = std::min<size_t>(uber->firstWorkerTasks, tasks.size);
+    queues[0].end = first;
+    numFixed = 1;
+  }
+  size_t rest = tasks.size - first;
+  uint32_t numShares = numThreads - numFixed;
+  for (uint32_t k = 0; k < numShares; ++k) {
+    WorkerQueue& queue = queues[numFixed + k];
+    queue.begin = first + rest * k / numShares;
+    queue.end = first + rest * (k + 1) / numShares;
+  }
+  if (numThreads == 1) {
+    run(0);
+  } else {
+#if !defined(__wasm__)
+    std::vector<std::unique_ptr<WorkerState>> states(numThreads);
+    TaskGroup group(uber->pool);
+    for (uint32_t i = 0; i < numThreads; ++i) {
+      states[i].reset(new WorkerState(*uber));
+      WorkerState* state = states[i].get();
+      group.spawn([this, &group, i, state] { runStep(&group, i, state); });
+    }
+    group.wait();
+    for (uint32_t i = 0; i < numThreads; ++i) finish(states[i].get());
+#endif
+  }
+  wallSeconds = secondsSince(start);
+}
+
+/*
+ * Schedules simulation of variants: all of them at once, a sweep in the list
+ * order with early termination, or a local search over the grid of partition
+ * code factors and line limit. In the latter case climbers start at seeds
+ * spread over the list; each round
+ * simulates the unseen neighbours of all the climbers in parallel, then every
+ * climber moves to its best neighbour, if that one is better. Search stops
+ * when no climber moves. Neighbours differ by 1 in one of the factors, or by
+ * 1 or 8 in line limit; only variants from the list are simulated.
+ */
+class VariantSearch {
+ public:
+  VariantSearch(const UberCache& uber, const Variant* variants,
+                size_t numVariants)
+      : uber(&uber),
+        variants(variants),
+        numVariants(numVariants),
+        round(numVariants, kNone),
+        slot(numVariants) {
+    for (size_t i = 0; i < numVariants; ++i) {
+      byKey.emplace(key(variants[i].partitionCode, variants[i].lineLimit), i);
+    }
+  }
+
+  ~VariantSearch() {
+    for (TaskExecutor* executor : rounds) delete executor;
+  }
+
+  void simulateAll(uint32_t targetSize, uint32_t numThreads) {
+    std::vector<size_t> all(numVariants);
+    for (size_t i = 0; i < numVariants; ++i) all[i] = i;
+    simulate(all, targetSize, numThreads);
+  }
+
+  /* Partitions of all variants but the best one are released after every
+     round. */
+  void climb(size_t numSeeds, uint32_t targetSize, uint32_t numThreads);
+
+  /*
+   * Simulates variants in the list order, a chunk at a time. Stops after
+   * |patience| variants in a row do not improve the best result (unless
+   * |patience| is 0), or once simulated variants cover |confidence| of the
+   * |weights| (if any). Partitions of all variants but the best one are
+   * released on the way. Returns the number of variants considered;
+   * variants simulated past that point are ignored, so the result does not
+   * depend on the chunk size.
+   */
+  size_t sweep(uint32_t patience, const float* weights, float confidence,
+               uint32_t targetSize, uint32_t numThreads);
+
+  /* Returns nullptr if variant was not simulated. */
+  const SimulationTask* variantTask(size_t i) const {
+    if (round[i] == kNone) return nullptr;
+    return &rounds[round[i]]->variantTask(slot[i]);
+  }
+
+  uint64_t approxSearches() const {
+    uint64_t result = 0;
+    for (const TaskExecutor* executor : rounds) {
+      result += executor->approxSearches;
+    }
+    return result;
+  }
+
+  uint64_t approxMismatches() const {
+    uint64_t result = 0;
+    for (const TaskExecutor* executor : rounds) {
+      result += executor->approxMismatches;
+    }
+    return result;
+  }
+
+  /* Fills per-worker utilization and returns the number of stolen tasks. */
+  uint64_t utilization(std::vector<float>* result) const {
+    std::vector<double> busy;
+    double wall = 0.0;
+    uint64_t numStolen = 0;
+    for (const TaskExecutor* executor : rounds) {
+      const std::vector<WorkerQueue>& queues = executor->queues;
+      if (busy.size() < queues.size()) busy.resize(queues.size());
+      for (size_t i = 0; i < queues.size(); ++i) {
+        busy[i] += queues[i].busySeconds;
+        numStolen += queues[i].numStolen;
+      }
+      wall += executor->wallSeconds;
+    }
+    result->resize(busy.size());
+    for (size_t i = 0; i < busy.size(); ++i) {
+      (*result)[i] = (wall > 0.0) ? static_cast<float>(busy[i] / wall) : 0.0f;
+    }
+    return numStolen;
+  }
+
+ private:
+  static constexpr size_t kNone = static_cast<size_t>(-1);
+
+  static uint32_t key(uint32_t partitionCode, uint32_t lineLimit) {
+    return partitionCode * CodecParams::kMaxLineLimit + lineLimit;
+  }
+
+  float sqe(size_t i) const { return variantTask(i)->bestSqe; }
+
+  /* The first of the best simulated variants that keep their partitions. */
+  size_t bestKept() const {
+    size_t best = kNone;
+    for (size_t i = 0; i < numVariants; ++i) {
+      const SimulationTask* task = variantTask(i);
+      if (!task || !task->partitionHolder) continue;
+      if (best == kNone || sqe(i) < sqe(best)) best = i;
+    }
+    return best;
+  }
+
+  /* Releases partitions of all simulated variants but the |keep|-th one. */
+  void release(size_t keep) {
+    SimulationTask* task = &rounds[round[keep]]->tasks.data[0];
+    task += rounds[round[keep]]->variantTasks[slot[keep]];
+    if (kept && kept != task) drop(kept);
+    kept = task;
+    for (; numReleased < rounds.size(); ++numReleased) {
+      Array<SimulationTask>& tasks = rounds[numReleased]->tasks;
+      for (size_t k = 0; k < tasks.size; ++k) {
+        if (tasks.data + k != kept) drop(tasks.data + k);
+      }
+    }
+  }
+
+  static void drop(SimulationTask* task) {
+    delete task->partitionHolder;
+    task->partitionHolder = nullptr;
+  }
+
+  /* Appends the listed neighbours of the |i|-th variant to |result|. */
+  void neighbours(size_t i, std::vector<size_t>* result) const {
+    uint32_t code = variants[i].partitionCode;
+    int32_t lineLimit = variants[i].lineLimit;
+    auto add = [&](uint32_t nextCode, int32_t nextLineLimit) {
+      if (nextCode == CodecParams::kInvalid) return;
+      if (nextLineLimit < 0 ||
+          nextLineLimit >= static_cast<int32_t>(CodecParams::kMaxLineLimit)) {
+        return;
+      }
+      auto it = byKey.find(key(nextCode, nextLineLimit));
+      if (it != byKey.end()) result->push_back(it->second);
+    };
+    for (int32_t delta = -1; delta <= 1; delta += 2) {
+      for (uint32_t f = 0; f < CodecParams::kNumPartitionFactors; ++f) {
+        add(CodecParams::stepPartitionCode(code, f, delta), lineLimit);
+      }
+      add(code, lineLimit + delta);
+      add(code, lineLimit + 8 * delta);
+    }
+  }
+
+  void simulate(const std::vector<size_t>& batch, uint32_t targetSize,
+                uint32_t numThreads) {
+    std::vector<Variant> selected(batch.size());
+    for (size_t j = 0; j < batch.size(); ++j) selected[j] = variants[batch[j]];
+    TaskExecutor* executor = new TaskExecutor(*uber, batch.size());
+    executor->simulate(selected.data(), selected.size(), targetSize,
+                       numThreads);
+    for (size_t j = 0; j < batch.size(); ++j) {
+      round[batch[j]] = rounds.size();
+      slot[batch[j]] = j;
+    }
+    rounds.push_back(executor);
+  }
+
+  const UberCache* uber;
+  const Variant* variants;
+  size_t numVariants;
+  /* (partition code, line limit) -> index of the first such variant */
+  std::unordered_map<uint32_t, size_t> byKey;
+  /* Where the simulation of the variant is. */
+  std::vector<size_t> round;
+  std::vector<size_t> slot;
+  std::vector<TaskExecutor*> rounds;
+  /* Rounds before this one have only "kept" partition alive. */
+  size_t numReleased = 0;
+  SimulationTask* kept = nullptr;
 };
 
+size_t VariantSearch::sweep(uint32_t patience, const float* weights,
+                            float confidence, uint32_t targetSize,
+                            uint32_t numThreads) {
+  const size_t chunk = 8 * static_cast<size_t>(std::max(numThreads, 1u));
+  bool useWeights = weights && (confidence > 0.0f);
+  float bestSqe = 1e35f;
+  size_t best = 0;
+  float covered = 0.0f;
+  size_t done = 0;
+  std::vector<size_t> batch;
+  while (done < numVariants && !uber->isCancelled()) {
+    batch.clear();
+    for (size_t i = done; i < std::min(done + chunk, numVariants); ++i) {
+      batch.push_back(i);
+    }
+    simulate(batch, targetSize, numThreads);
+    size_t end = done + batch.size();
+    bool stop = false;
+    for (; done < end && !stop; ++done) {
+      if (sqe(done) < bestSqe) {
+        bestSqe = sqe(done);
+        best = done;
+      }
+      if (useWeights) covered += weights[done];
+      stop = (patience > 0 && done - best >= patience) ||
+             (useWeights && covered >= confidence);
+    }
+    release(best);
+    if (stop) break;
+  }
+  return done;
+}
+
+void VariantSearch::climb(size_t numSeeds, uint32_t targetSize,
+                          uint32_t numThreads) {
+  numSeeds = std::min(numSeeds, numVariants);
+  std::vector<size_t> climbers(numSeeds);
+  for (size_t k = 0; k < numSeeds; ++k) {
+    climbers[k] = (2 * k + 1) * numVariants / (2 * numSeeds);
+  }
+  simulate(climbers, targetSize, numThreads);
+  std::vector<size_t> around;
+  std::vector<size_t> batch;
+  std::vector<bool> pending(numVariants, false);
+  while (!uber->isCancelled()) {
+    batch.clear();
+    for (size_t climber : climbers) {
+      around.clear();
+      neighbours(climber, &around);
+      for (size_t i : around) {
+        if (round[i] != kNone || pending[i]) continue;
+        pending[i] = true;
+        batch.push_back(i);
+      }
+    }
+    if (!batch.empty()) simulate(batch, targetSize, numThreads);
+    for (size_t i : batch) pending[i] = false;
+    // Only the best partition could be chosen in the end.
+    size_t best = bestKept();
+    if (best != kNone) release(best);
+
+    bool moved = false;
+    for (size_t& climber : climbers) {
+      around.clear();
+      neighbours(climber, &around);
+      size_t best = climber;
+      for (size_t i : around) {
+        if (sqe(i) < sqe(best) || (sqe(i) == sqe(best) && i < best)) {
+          best = i;
+        }
+      }
+      if (sqe(best) < sqe(climber)) {
+        climber = best;
+        moved = true;
+      }
+    }
+    if (!moved) break;
+  }
+}
+
+uint32_t SubdivisionCache::child(const CodecParams& cp, const Fragment& parent,
+                                 bool left) {
+  if (parent.shared_key == kNone) return kNone;
+  uint32_t angle = parent.best_angle_code *
+                   (SinCos.kMaxAngle >> cp.angle_bits[parent.level]);
+  uint64_t key = (static_cast<uint64_t>(parent.shared_key) << 42) |
+                 (static_cast<uint64_t>(angle) << 33) |
+                 (static_cast<uint64_t>(left ? 1 : 0) << 32) |
+                 static_cast<uint32_t>(parent.best_distance);
+#if !defined(__wasm__)
+  std::lock_guard<std::mutex> lock(mutex);
+#endif
+  uint32_t child_depth = depth[parent.shared_key] + 1u;
+  if (child_depth > maxDepth) return kNone;
+  auto it = regions.find(key);
+  if (it != regions.end()) return it->second;
+  if (depth.size() >= kMaxRegions) return kNone;
+  uint32_t result = static_cast<uint32_t>(depth.size());
+  depth.push_back(static_cast<uint8_t>(child_depth));
+  regions.emplace(key, result);
+  return result;
+}
+
+static uint32_t resultKey(const CodecParams& cp, const Fragment& f) {
+  return (f.shared_key << 10) | (cp.angle_bits[f.level] << 6) | cp.line_limit;
+}
+
+bool SubdivisionCache::find(const CodecParams& cp, Fragment* f) {
+  if (f->shared_key == kNone) return false;
+  SubdivisionResult r;
+  {
+#if !defined(__wasm__)
+    std::lock_guard<std::mutex> lock(mutex);
+#endif
+    auto it = results.find(resultKey(cp, *f));
+    if (it == results.end()) return false;
+    r = it->second;
+  }
+  f->loadSearch(r);
+  return true;
+}
+
+void SubdivisionCache::store(const CodecParams& cp, const Fragment& f) {
+  if (f.shared_key == kNone) return;
+  SubdivisionResult r;
+  f.saveSearch(&r);
+#if !defined(__wasm__)
+  std::lock_guard<std::mutex> lock(mutex);
+#endif
+  results.emplace(resultKey(cp, f), r);
+}
+
+void Fragment::saveSearch(SubdivisionResult* dst) const {
+  dst->best_score = best_score;
+  dst->best_cost = best_cost;
+  dst->best_angle_code = best_angle_code;
+  dst->best_line = best_line;
+  dst->best_num_lines = best_num_lines;
+  dst->best_distance = best_distance;
+  dst->left_rows = left_rows;
+  dst->right_rows = right_rows;
+}
+
+void Fragment::loadSearch(const SubdivisionResult& src) {
+  searched = true;
+  best_score = src.best_score;
+  best_cost = src.best_cost;
+  best_angle_code = src.best_angle_code;
+  best_line = src.best_line;
+  best_num_lines = src.best_num_lines;
+  best_distance = src.best_distance;
+  left_rows = src.left_rows;
+  right_rows = src.right_rows;
+}
+
+void Fragment::split(Arena* arena, const CodecParams& cp) {
+  int32_t angle = best_angle_code * (SinCos.kMaxAngle >> cp.angle_bits[level]);
+  leftChild = new (arena) Fragment(arena, left_rows);
+  rightChild = new (arena) Fragment(arena, right_rows);
+  Region::splitLine(*region, angle, best_distance, leftChild->region,
+                    rightChild->region);
+}
+
 NOINLINE void Fragment::encode(XRangeEncoder* dst, const CodecParams& cp,
                                bool is_leaf, const float* RESTRICT palette,
                                Array<Fragment*>* children) {
@@ -295,19 +1303,8 @@ static uint32_t fold(PqNode* storage, uint32_t node) {
   return merge(storage, merge(storage, node, sibling), fold(storage, tail));
 }
 
-/**
- * Builds the space partition.
- *
- * Minimal color data cost is used.
- * Partition could be used to try multiple color quantization to see, which one
- * gives the best result.
- */
-NOINLINE void buildPartition(Fragment* root, size_t size_limit,
-                             const CodecParams& cp, Cache* cache,
-                             Array<Fragment*>* result) {
-  float tax = SinCos.kLog2[NodeType::COUNT];
-  float budget = size_limit * 8.0f - tax - cache->uber->imageTax;
-
+/* Sets |root| region to the whole image and measures it. */
+void initRoot(Fragment* root, Cache* cache, const CodecParams& cp) {
   uint32_t width = cache->uber->width;
   uint32_t height = cache->uber->height;
   uint32_t step = vecSize(height);
@@ -319,16 +1316,32 @@ NOINLINE void buildPartition(Fragment* root, size_t size_limit,
   }
   root->region->len = height;
 
-  findBestSubdivision(root, cache, cp);
+  if (cache->uber->shared) root->shared_key = SubdivisionCache::kRoot;
+  measureFragment(root, cache, cp);
+}
 
-  size_t maxQueueSize = 2 * 8 * size_limit + 2;
+/*
+ * Splits the best fragments of the subtree of measured |top| while they fit
+ * the |budget| (in bits); accepted fragments are appended to |result|.
+ * |size_limit| bounds the number of queued fragments.
+ */
+static NOINLINE void growPartition(Fragment* top, size_t size_limit,
+                                   float budget, const CodecParams& cp,
+                                   Cache* cache, Arena* arena,
+                                   SearchPool* pool,
+                                   Array<Fragment*>* result) {
+  float tax = SinCos.kLog2[NodeType::COUNT];
+  SubdivisionCache* shared = cache->uber->shared;
+
+  // Each fragment is pushed at most twice: with bounds and after search.
+  size_t maxQueueSize = 4 * 8 * size_limit + 3;
   Array<PqNode> queue(maxQueueSize);
   // 0-th node is a "nullptr"
   CHECK_ARRAY_CAN_GROW(queue);
   initPqNode(queue.data + queue.size++, nullptr);
   uint32_t rootNode = queue.size;
   CHECK_ARRAY_CAN_GROW(queue);
-  initPqNode(queue.data + queue.size++, root);
+  initPqNode(queue.data + queue.size++, top);
 
   while (rootNode != 0) {
     Fragment* candidate = queue.data[rootNode].v;
@@ -337,26 +1350,264 @@ NOINLINE void buildPartition(Fragment* root, size_t size_limit,
     if (candidate->best_score < 0.0f || candidate->best_cost < 0.0f) break;
     // TODO(eustas): add color tax!!!
     float cost = tax + candidate->best_cost;
-    if (cost <= budget) {
-      budget -= cost;
-      candidate->ordinal = static_cast<uint32_t>(result->size);
-      CHECK_ARRAY_CAN_GROW(*result);
-      result->data[result->size++] = candidate;
-      findBestSubdivision(candidate->leftChild, cache, cp);
+    if (cost > budget) continue;
+    if (!candidate->searched) {
+      if (!shared || !shared->find(cp, candidate)) {
+#if defined(__wasm__)
+        findBestSubdivision(candidate, cache, cp);
+#else
+        if (pool) {
+          pool->find(candidate, cache);
+        } else {
+          findBestSubdivision(candidate, cache, cp);
+        }
+#endif
+        if (shared) shared->store(cp, *candidate);
+      }
       CHECK_ARRAY_CAN_GROW(queue);
-      initPqNode(queue.data + queue.size, candidate->leftChild);
+      initPqNode(queue.data + queue.size, candidate);
       rootNode = merge(queue.data, rootNode, queue.size++);  // push
-      findBestSubdivision(candidate->rightChild, cache, cp);
+      continue;
+    }
+    budget -= cost;
+    candidate->ordinal = static_cast<uint32_t>(result->size);
+    CHECK_ARRAY_CAN_GROW(*result);
+    result->data[result->size++] = candidate;
+    candidate->split(arena, cp);
+    if (shared) {
+      candidate->leftChild->shared_key = shared->child(cp, *candidate, true);
+      candidate->rightChild->shared_key = shared->child(cp, *candidate, false);
+    }
+    Fragment* children[2] = {candidate->leftChild, candidate->rightChild};
+    for (Fragment* child : children) {
+      measureFragment(child, cache, cp);
+#if !defined(__wasm__)
+      // Budget only shrinks; fragments that do not fit now are never searched.
+      if (pool && !child->searched && tax + child->best_cost <= budget) {
+        pool->submit(child);
+      }
+#endif
       CHECK_ARRAY_CAN_GROW(queue);
-      initPqNode(queue.data + queue.size, candidate->rightChild);
+      initPqNode(queue.data + queue.size, child);
       rootNode = merge(queue.data, rootNode, queue.size++);  // push
     }
   }
 }
 
-Partition::Partition(Cache* cache, const CodecParams& cp, size_t targetSize)
-    : root(cache->uber->height), partition(targetSize * 4) {
-  buildPartition(&root, targetSize, cp, cache, &partition);
+/**
+ * Builds the space partition.
+ *
+ * Minimal color data cost is used.
+ * Partition could be used to try multiple color quantization to see, which one
+ * gives the best result.
+ *
+ * Subdivision search is lazy: fragments are queued with score / cost bounds;
+ * search is done only when fragment is popped and could fit the budget; then
+ * fragment is re-queued with the actual score.
+ */
+NOINLINE void buildPartition(Fragment* root, size_t size_limit,
+                             const CodecParams& cp, Cache* cache, Arena* arena,
+                             SearchPool* pool, Array<Fragment*>* result) {
+  float tax = SinCos.kLog2[NodeType::COUNT];
+  float budget = size_limit * 8.0f - tax - cache->uber->imageTax;
+  initRoot(root, cache, cp);
+  growPartition(root, size_limit, budget, cp, cache, arena, pool, result);
+}
+
+/*
+ * Splits the longer side of the measured fragment bounding box in the middle:
+ * angle code 0 cuts rows, angle_max / 2 (if angle bits allow) cuts columns.
+ * Returns false (and leaves fragment intact) if fragment is near-uniform,
+ * split does not fit the |budget| or produces an empty region.
+ */
+static bool forceSplit(Fragment* f, Cache* cache, const CodecParams& cp,
+                       float budget) {
+  if (f->best_cost < 0.0f) return false;
+  const Vector<int32_t>& region = *f->region;
+  const size_t step = region.capacity / 3;
+  const int32_t* RESTRICT y = region.data();
+  const int32_t* RESTRICT x0 = y + step;
+  const int32_t* RESTRICT x1 = x0 + step;
+  int32_t min_x = x0[0];
+  int32_t max_x = x1[0];
+  for (size_t i = 1; i < region.len; ++i) {
+    min_x = std::min(min_x, x0[i]);
+    max_x = std::max(max_x, x1[i]);
+  }
+  // Rows are sorted.
+  int32_t height = y[region.len - 1] + 1 - y[0];
+  uint32_t angle_max = 1u << cp.angle_bits[f->level];
+  uint32_t angle_code =
+      ((angle_max > 1) && (max_x - min_x > height)) ? angle_max / 2 : 0;
+  int32_t angle = angle_code * (SinCos.kMaxAngle / angle_max);
+  DistanceRange distance_range(region, angle, cp);
+  uint32_t num_lines = distance_range.num_lines;
+  float cost = SinCos.kLog2[NodeType::COUNT] + cp.angle_bits[f->level] +
+               SinCos.kLog2[num_lines];
+  if (SinCos.kLog2[NodeType::COUNT] + cost > budget) return false;
+  uint32_t line = num_lines / 2;
+  int32_t distance = distance_range.distance(line);
+  Region::splitLine(region, angle, distance, cache->split_left,
+                    cache->split_right);
+  if (cache->split_left->len == 0 || cache->split_right->len == 0) {
+    return false;
+  }
+  f->searched = true;
+  f->best_angle_code = angle_code;
+  f->best_line = line;
+  f->best_num_lines = num_lines;
+  f->best_distance = distance;
+  f->left_rows = cache->split_left->len;
+  f->right_rows = cache->split_right->len;
+  f->best_cost = cost;
+  return true;
+}
+
+/*
+ * Same as buildPartition, but top |tilingLevels| levels are forced splits;
+ * subtrees of the resulting tiles are grown independently (in parallel,
+ * if |numThreads| > 1, then fragments are allocated in |tileArenas|) and
+ * merged best-first within the remaining budget.
+ */
+NOINLINE void buildTiledPartition(Fragment* root, size_t size_limit,
+                                  const CodecParams& cp, Cache* cache,
+                                  Arena* arena, uint32_t numThreads,
+                                  std::vector<Arena*>* tileArenas,
+                                  Array<Fragment*>* result) {
+  const UberCache& uber = *cache->uber;
+  float tax = SinCos.kLog2[NodeType::COUNT];
+  float budget = size_limit * 8.0f - tax - uber.imageTax;
+  SubdivisionCache* shared = uber.shared;
+  initRoot(root, cache, cp);
+
+  std::vector<Fragment*> tiles(1, root);
+  for (uint32_t level = 0; level < uber.tilingLevels; ++level) {
+    std::vector<Fragment*> next;
+    for (Fragment* tile : tiles) {
+      if (!forceSplit(tile, cache, cp, budget)) {
+        next.push_back(tile);
+        continue;
+      }
+      budget -= tax + tile->best_cost;
+      tile->ordinal = static_cast<uint32_t>(result->size);
+      CHECK_ARRAY_CAN_GROW(*result);
+      result->data[result->size++] = tile;
+      tile->split(arena, cp);
+      if (shared) {
+        tile->leftChild->shared_key = shared->child(cp, *tile, true);
+        tile->rightChild->shared_key = shared->child(cp, *tile, false);
+      }
+      measureFragment(tile->leftChild, cache, cp);
+      measureFragment(tile->rightChild, cache, cp);
+      next.push_back(tile->leftChild);
+      next.push_back(tile->rightChild);
+    }
+    tiles.swap(next);
+  }
+
+  // Tile gets a share of budget by its score bound, with a slack; the
+  // actual division is done by merge.
+  const size_t numTiles = tiles.size();
+  std::vector<float> tileBudget(numTiles, 0.0f);
+  float totalBound = 0.0f;
+  for (Fragment* tile : tiles) {
+    if (tile->best_score > 0.0f) totalBound += tile->best_score;
+  }
+  for (size_t i = 0; i < numTiles; ++i) {
+    if (tiles[i]->best_score <= 0.0f) continue;
+    float share = 2.0f * tiles[i]->best_score / totalBound;
+    tileBudget[i] = budget * std::min(1.0f, share);
+  }
+  std::vector<Array<Fragment*>*> lists(numTiles);
+  for (size_t i = 0; i < numTiles; ++i) {
+    lists[i] = new Array<Fragment*>(result->capacity);
+  }
+  auto growTiles = [&](size_t first, size_t stride, Cache* tileCache,
+                       Arena* tileArena) {
+    for (size_t i = first; i < numTiles; i += stride) {
+      if (tileBudget[i] <= 0.0f) continue;
+      growPartition(tiles[i], size_limit, tileBudget[i], cp, tileCache,
+                    tileArena, nullptr, lists[i]);
+    }
+  };
+  numThreads = std::min<size_t>(numThreads, numTiles);
+#if defined(__wasm__)
+  numThreads = 1;
+#endif
+  if (numThreads <= 1) {
+    growTiles(0, 1, cache, arena);
+  } else {
+#if !defined(__wasm__)
+    TaskGroup group(uber.pool);
+    for (uint32_t i = 0; i < numThreads; ++i) {
+      Arena* tileArena = new Arena();
+      tileArenas->push_back(tileArena);
+      group.spawn([&, i, tileArena]() {
+        Cache tileCache(uber);
+        growTiles(i, numThreads, &tileCache, tileArena);
+      });
+    }
+    group.wait();
+#endif
+  }
+
+  // Best head of the tile lists goes first; list order is kept, so parents
+  // precede children. A tile is done once its head does not fit.
+  std::vector<size_t> heads(numTiles, 0);
+  std::vector<bool> done(numTiles, false);
+  while (true) {
+    size_t best = numTiles;
+    for (size_t i = 0; i < numTiles; ++i) {
+      if (done[i]) continue;
+      if (heads[i] == lists[i]->size) {
+        done[i] = true;
+        continue;
+      }
+      if (best == numTiles || lists[i]->data[heads[i]]->best_score >
+                                  lists[best]->data[heads[best]]->best_score) {
+        best = i;
+      }
+    }
+    if (best == numTiles) break;
+    Fragment* node = lists[best]->data[heads[best]];
+    float cost = tax + node->best_cost;
+    if (cost > budget) {
+      done[best] = true;
+      continue;
+    }
+    budget -= cost;
+    heads[best]++;
+    node->ordinal = static_cast<uint32_t>(result->size);
+    CHECK_ARRAY_CAN_GROW(*result);
+    result->data[result->size++] = node;
+  }
+  for (size_t i = 0; i < numTiles; ++i) {
+    // Rejected splits are leaves.
+    for (size_t j = heads[i]; j < lists[i]->size; ++j) {
+      lists[i]->data[j]->ordinal = 0x7FFFFFFF;
+    }
+    delete lists[i];
+  }
+}
+
+Partition::Partition(Arena* arena, Cache* cache, const CodecParams& cp,
+                     size_t targetSize, SearchPool* pool,
+                     uint32_t numThreads)
+    : arena(arena),
+      root(new (arena) Fragment(arena, cache->uber->height)),
+      partition(targetSize * 4) {
+  if (cache->uber->tilingLevels > 0) {
+    buildTiledPartition(root, targetSize, cp, cache, arena, numThreads,
+                        &tileArenas, &partition);
+    return;
+  }
+  buildPartition(root, targetSize, cp, cache, arena, pool, &partition);
+}
+
+Arena* Partition::releaseArena() {
+  Arena* result = arena;
+  arena = nullptr;
+  return result;
 }
 
 const Array<Fragment*>* Partition::getPartition() const { return &partition; }
@@ -387,67 +1638,156 @@ uint32_t Partition::subpartition(float imageTax, const CodecParams& cp,
 
 namespace Encoder {
 
-Result encode(const Image& src, const Params& params) {
-  Result result{};
+static void setupCache(UberCache* uber, const Params& params,
+                       size_t numVariants,
+                       const std::atomic<bool>* cancelled) {
+  uber->cancelled = cancelled;
+#if !defined(__wasm__)
+  uber->pool = params.pool ? params.pool : ThreadPool::shared();
+#endif
+  uber->firstWorkerTasks = params.firstWorkerTasks;
+  if (params.approxRowStride > 1) {
+    uber->approxRowStride = params.approxRowStride;
+    uber->approxTopK = std::max<uint32_t>(1, std::min<uint32_t>(
+        params.approxTopK, CodecParams::kMaxLineLimit * SinCos.kMaxAngle));
+  }
+  if (params.coarseAngleStep > 1) {
+    uber->coarseAngleStep = params.coarseAngleStep;
+    uber->coarseSeeds = std::max<uint32_t>(
+        1, std::min<uint32_t>(params.coarseSeeds, SinCos.kMaxAngle));
+  }
+  uber->warmPalettes = params.warmPalettes;
+  uber->parallelSearchRows = params.parallelSearchRows;
+  uber->tilingLevels = std::min<uint32_t>(params.tilingLevels, 8);
+  if (params.sharedSearchDepth > 0 && numVariants > 1) {
+    uber->shared = new SubdivisionCache(
+        std::min<uint32_t>(params.sharedSearchDepth, 255) - 1);
+  }
+}
+
+/* Power of 2 that brings the longer side down to |proxySize|. */
+static uint32_t proxyFactor(uint32_t width, uint32_t height,
+                            uint32_t proxySize) {
+  uint32_t factor = 1;
+  while (std::max(width, height) > proxySize * factor) {
+    // Proxy should be a valid input as well.
+    uint32_t next = 2 * factor;
+    if ((std::min(width, height) + next - 1) / next < 9) break;
+    factor = next;
+  }
+  return factor;
+}
+
+/*
+ * Simulates all the variants on the image downscaled by |factor|; returns
+ * indices of Params::proxyVariants best of them, in the original order.
+ */
+static std::vector<size_t> shortlistVariants(
+    const Image& src, uint32_t factor, const Params& params,
+    const std::atomic<bool>* cancelled) {
+  size_t numVariants = params.numVariants;
+  Image proxy = Image::downscale(src, factor);
+  UberCache uber(proxy, 0);
+  setupCache(&uber, params, numVariants, cancelled);
+  TaskExecutor executor(uber, numVariants);
+  executor.simulate(params.variants, numVariants, params.targetSize,
+                    params.numThreads);
+  std::vector<float> sqe(numVariants);
+  std::vector<size_t> order(numVariants);
+  for (size_t i = 0; i < numVariants; ++i) {
+    const SimulationTask& task = executor.variantTask(i);
+    // Partitions of all but the best task are recycled; results stay.
+    sqe[i] = task.bestSqe;
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&](size_t l, size_t r) { return sqe[l] < sqe[r]; });
+  order.resize(params.proxyVariants);
+  std::sort(order.begin(), order.end());
+  return order;
+}
+
+/* Encodes into |out|; returns early (and leaves it empty) if cancelled. */
+static void encodeTo(const Image& src, const Params& params,
+                     const std::atomic<bool>* cancelled, Result* out) {
+  Result& result = *out;
 
   int32_t width = src.width;
   int32_t height = src.height;
   if (width < 9 || height < 9) {
     if (params.debug) log("image is too small");
-    return result;
+    return;
   }
   if (width > 2048 || height > 2048) {
     if (params.debug) log("image is too large");
-    return result;
+    return;
   }
-  UberCache uber(src);
   const Variant* variants = params.variants;
   size_t numVariants = params.numVariants;
   if (numVariants == 0) {
     if (params.debug) log("no encoding variants specified");
-    return result;
+    return;
   }
 
   for (size_t i = 0; i < numVariants; ++i) {
     if (variants[i].colorOptions == 0) {
       if (params.debug) log("varinat without colorOptions is requested");
-      return result;
+      return;
     }
   }
 
-  TaskExecutor executor(uber, numVariants);
-  SimulationTask* tasks = executor.tasks.data;
-  for (size_t i = 0; i < numVariants; ++i) {
-    new(tasks + i) SimulationTask(params.targetSize, variants[i], uber);
+  const float* weights = params.variantWeights;
+  std::vector<Variant> shortlist;
+  std::vector<float> shortlistWeights;
+  if (params.proxySize > 0 && params.proxyVariants > 0 &&
+      numVariants > params.proxyVariants) {
+    uint32_t factor = proxyFactor(width, height, params.proxySize);
+    if (factor > 1) {
+      result.shortlist = shortlistVariants(src, factor, params, cancelled);
+      for (size_t i : result.shortlist) {
+        shortlist.push_back(variants[i]);
+        if (weights) shortlistWeights.push_back(weights[i]);
+      }
+      variants = shortlist.data();
+      numVariants = shortlist.size();
+      if (weights) weights = shortlistWeights.data();
+    }
   }
-  executor.tasks.size = numVariants;
-#if defined(__wasm__)
-  executor.run();
-#else
-  size_t numThreads = std::min<size_t>(params.numThreads, numVariants);
-  std::vector<std::future<void>> futures;
-  futures.reserve(numThreads);
-  bool singleThreaded = (numThreads == 1);
-  for (uint32_t i = 0; i < numThreads; ++i) {
-    futures.push_back(
-        std::async(singleThreaded ? std::launch::deferred : std::launch::async,
-                   &TaskExecutor::run, &executor));
+
+  UberCache uber(src, params.shearTableBits);
+  setupCache(&uber, params, numVariants, cancelled);
+  VariantSearch search(uber, variants, numVariants);
+  if (params.localSearchSeeds > 0) {
+    search.climb(params.localSearchSeeds, params.targetSize,
+                 params.numThreads);
+  } else if (params.patience > 0 || (weights && params.confidence > 0.0f)) {
+    numVariants = search.sweep(params.patience, weights, params.confidence,
+                               params.targetSize, params.numThreads);
+  } else {
+    search.simulateAll(params.targetSize, params.numThreads);
   }
-  for (uint32_t i = 0; i < numThreads; ++i) futures[i].get();
-#endif
-  size_t bestTaskIndex = 0;
+  if (uber.isCancelled()) {
+    result.cancelled = true;
+    return;
+  }
+  size_t bestVariantIndex = 0;
   float bestSqe = 1e35f;
-  for (size_t taskIndex = 0; taskIndex < numVariants; ++taskIndex) {
-    const SimulationTask& task = tasks[taskIndex];
-    if (!task.partitionHolder) continue;
-    if (task.bestSqe < bestSqe) {
-      bestTaskIndex = taskIndex;
-      bestSqe = task.bestSqe;
+  for (size_t i = 0; i < numVariants; ++i) {
+    const SimulationTask* task = search.variantTask(i);
+    if (!task || !task->partitionHolder) continue;
+    if (task->bestSqe < bestSqe) {
+      bestVariantIndex = i;
+      bestSqe = task->bestSqe;
     }
   }
-  SimulationTask& bestTask = tasks[bestTaskIndex];
+  const Variant& bestVariant = variants[bestVariantIndex];
+  const SimulationTask& bestTask = *search.variantTask(bestVariantIndex);
 
-  CodecParams& cp = bestTask.cp;
+  // Partition of the simulated variant is the same; header is written with
+  // the chosen variant parameters.
+  CodecParams cp(width, height);
+  cp.setPartitionCode(bestVariant.partitionCode);
+  cp.line_limit = bestVariant.lineLimit + 1;
   uint32_t bestColorCode = bestTask.bestColorCode;
   cp.setColorCode(bestColorCode);
   const Partition& partitionHolder = *bestTask.partitionHolder;
@@ -457,24 +1797,56 @@ Result encode(const Image& src, const Params& params) {
   uint32_t numNonLeaf =
       partitionHolder.subpartition(uber.imageTax, cp, params.targetSize);
   const Array<Fragment*>* partition = partitionHolder.getPartition();
-  // TODO(eustas): gather patches only if going to build palette.
-  Vector<float>* patches = gatherPatches(partition, numNonLeaf);
-  Vector<float>* palette = buildPalette(patches, cp.palette_size);
-  float* RESTRICT colors = palette->data();
+  // Palette is the same as in simulation.
+  const float* RESTRICT colors = bestTask.bestPalette->data();
   doEncode(numNonLeaf, partition->data[0], cp, colors, &result.data);
-  delete patches;
-  delete palette;
   // << Encoder workflow
 
-  result.variant = bestTask.variant;
+  result.variant = bestVariant;
   result.variant.colorOptions = (uint64_t)1 << bestColorCode;
   result.mse = (bestSqe + uber.sqeBase) / static_cast<float>(width * height);
+  result.approxSearches = search.approxSearches();
+  result.approxMismatches = search.approxMismatches();
+  result.stolenBatches = search.utilization(&result.workerUtilization);
+}
+
+Result encode(const Image& src, const Params& params) {
+  Result result{};
+  encodeTo(src, params, nullptr, &result);
+  return result;
+}
 
-  for (size_t i = 0; i < numVariants; ++i) tasks[i].~SimulationTask();
+#if !defined(__wasm__)
+Encoding::Encoding(const Image& src, const Params& params)
+    : src(src),
+      params(params),
+      driver(params.pool ? params.pool : ThreadPool::shared()) {}
+
+Encoding::~Encoding() {
+  cancel();
+  driver.wait();
+}
 
+void Encoding::cancel() { cancelled = true; }
+
+bool Encoding::done() const { return finished; }
+
+const Result& Encoding::wait() {
+  driver.wait();
   return result;
 }
 
+std::unique_ptr<Encoding> encodeAsync(const Image& src, const Params& params) {
+  std::unique_ptr<Encoding> encoding(new Encoding(src, params));
+  Encoding* self = encoding.get();
+  self->driver.spawn([self] {
+    encodeTo(self->src, self->params, &self->cancelled, &self->result);
+    self->finished = true;
+  });
+  return encoding;
+}
+#endif
+
 }  // namespace Encoder
 
 }  // namespace twim
@@ -1,11 +1,22 @@
 #ifndef TWIM_ENCODER
 #define TWIM_ENCODER
 
+#if !defined(__wasm__)
+#include <atomic>
+#include <memory>
+#endif
+#include <vector>
+
 #include "image.h"
 #include "platform.h"
+#if !defined(__wasm__)
+#include "thread_pool.h"
+#endif
 
 namespace twim {
 
+class ThreadPool;
+
 namespace Encoder {
 
 struct Variant {
@@ -19,6 +30,69 @@ struct Params {
   uint32_t numThreads = 1;
   const Variant* variants;
   size_t numVariants;
+  /* Precompute sheared cumulative sums for near-vertical angles (multiples of
+     512 >> shearTableBits); lines of those angles are evaluated in O(1),
+     though with slightly coarser rasterization. Each table takes about
+     16 * (width + height) * height bytes. 0 means no tables. */
+  uint32_t shearTableBits = 0;
+  /* Approximate subdivision search: candidates for big fragments are scored
+     using every approxRowStride-th row only, then approxTopK best of them
+     are re-evaluated exactly. 1 means exact search. */
+  uint32_t approxRowStride = 1;
+  uint32_t approxTopK = 16;
+  /* Coarse-to-fine subdivision search: first lines of every
+     coarseAngleStep-th angle are evaluated; then the search is refined
+     around coarseSeeds best of those angles (ranked by their best line):
+     all angles closer than coarseAngleStep are evaluated. 1 means exhaustive search. Takes precedence over
+     approximate search. */
+  uint32_t coarseAngleStep = 1;
+  uint32_t coarseSeeds = 4;
+  /* Subdivision search results for the top sharedSearchDepth levels of the
+     tree are shared between variants; this does not affect the output.
+     0 means no sharing. */
+  uint32_t sharedSearchDepth = 16;
+  /* Angles of exact subdivision search of fragments with at least
+     parallelSearchRows rows are split between the spare threads of a
+     variant; this does not affect the output. 0 means no splitting. */
+  uint32_t parallelSearchRows = 512;
+  /* Tiling: top tilingLevels (up to 8) levels of the tree split the longer
+     side of the region in the middle; subtrees of the resulting tiles are
+     built independently (by the spare threads of a variant), and the budget
+     is divided between tiles by split gains. The output is a regular stream,
+     but it differs from (and is usually a bit worse than) the default one.
+     0 means no tiling. */
+  uint32_t tilingLevels = 0;
+  /* Proxy variant search: all the variants are simulated on the image
+     area-downscaled by a power of 2, so that the longer side is not greater
+     than proxySize; then only proxyVariants best of them are simulated at
+     full resolution. 0 means no proxy search. */
+  uint32_t proxySize = 0;
+  uint32_t proxyVariants = 16;
+  /* Local variant search: instead of simulating all the variants, start
+     localSearchSeeds hill climbers over partition code factors and line
+     limit; neighbours are simulated until no climber improves. Applies after
+     proxy search. 0 means all the variants are simulated. */
+  uint32_t localSearchSeeds = 0;
+  /* Early termination: variants are simulated in the list order (e.g. ranked
+     by a prior, most likely winners first); simulation stops after patience
+     variants in a row do not improve the result, or once the simulated
+     variants cover confidence of variantWeights (prior probabilities to win,
+     optional). 0 means no early termination. Local search takes precedence. */
+  uint32_t patience = 0;
+  const float* variantWeights = nullptr;
+  float confidence = 0.0f;
+  /* Palette of each size is seeded with the centers of the previous one,
+     instead of being built from scratch; faster, but the palettes (and the
+     output) are slightly different. */
+  bool warmPalettes = false;
+  /* Pool that runs the jobs of the encoding; nullptr means the shared one.
+     Pool without threads runs the jobs in the thread that waits for them,
+     one by one in the order they are queued. */
+  ThreadPool* pool = nullptr;
+  /* Testing: number of variants the first simulation worker starts with;
+     other workers split the rest. 0 means all the workers start with the
+     same share. */
+  uint32_t firstWorkerTasks = 0;
   bool debug = false;
 };
 
@@ -28,10 +102,69 @@ struct Result {
   Array<uint8_t> data;
   Variant variant;
   float mse;
+  /* Approximate subdivision search: number of searches, and number of those,
+     where exact re-evaluation changed the winner. */
+  uint64_t approxSearches = 0;
+  uint64_t approxMismatches = 0;
+  /* Share of the simulation time each worker thread was busy, and number
+     of variants that idle workers took over from others. */
+  std::vector<float> workerUtilization;
+  uint64_t stolenBatches = 0;
+  /* Indices of the variants kept by the proxy search, in the list order;
+     empty if there was no proxy search. */
+  std::vector<size_t> shortlist;
+  /* Encoding was cancelled before it finished; data is empty. */
+  bool cancelled = false;
 };
 
+/*
+ * Encodes in the calling thread; Params::numThreads - 1 more jobs at most
+ * are run by the thread pool (see Params::pool).
+ */
 Result encode(const Image& src, const Params& params);
 
+#if !defined(__wasm__)
+/*
+ * Encoding started by encodeAsync. Source image, params, variants and their
+ * weights should outlive it. Destruction cancels the encoding and waits for
+ * it to stop.
+ */
+class Encoding {
+ public:
+  ~Encoding();
+
+  /* Makes the encoding stop soon, unless it is done already; the result is
+     then marked cancelled. Variants that are being simulated are finished,
+     so it does not stop immediately. */
+  void cancel();
+  bool done() const;
+  /* Blocks until the encoding is done; could be called by several threads. */
+  const Result& wait();
+
+ private:
+  friend std::unique_ptr<Encoding> encodeAsync(const Image& src,
+                                               const Params& params);
+  Encoding(const Image& src, const Params& params);
+
+  const Image& src;
+  const Params params;
+  Result result;
+  std::atomic<bool> cancelled{false};
+  std::atomic<bool> finished{false};
+  /* Runs the job that does what the thread calling encode() would do. */
+  TaskGroup driver;
+};
+
+/*
+ * Starts encoding in the background. Driver of the encoding is a job of the
+ * pool (see Params::pool) that spawns the same jobs as encode(), so
+ * concurrent encodings share the pool threads; their jobs take turns. While
+ * the driver waits for its jobs, its thread is given up to other jobs.
+ * Driver that is not taken by a pool thread yet is run by Encoding::wait.
+ */
+std::unique_ptr<Encoding> encodeAsync(const Image& src, const Params& params);
+#endif
+
 }  // namespace Encoder
 
 }  // namespace twim
@@ -1,22 +1,111 @@
 #ifndef TWIM_ENCODER_INTERNAL
 #define TWIM_ENCODER_INTERNAL
 
+#include <atomic>
 #include <cmath>
 #include <memory>
+#if !defined(__wasm__)
+#include <mutex>
+#endif
+#include <unordered_map>
 #include <vector>
 
 #include "platform.h"
+#include "sin_cos.h"
 
 namespace twim {
 
 class CodecParams;
+class Fragment;
 struct Image;
+class ThreadPool;
+class SearchPool;
 class XRangeEncoder;
 
+class UberCache;
+
+/*
+ * Cumulative sums along the lines of a single angle.
+ *
+ * Line "c" crosses row "y" at x = c + shift[y]; sum[(y + 1) * stride + 4 * c]
+ * is [r, g, b, count] sum of pixels to the left of line "c" in rows 0..y.
+ * Thus, sum over rows y0..y1 to the left of the line is just 2 lookups.
+ */
+class ShearTable {
+ public:
+  ~ShearTable() {
+    delete shift;
+    delete sum;
+  }
+
+  int32_t c_min;
+  uint32_t c_count;
+  uint32_t stride;
+  Vector<int32_t>* shift;
+  Vector<int32_t>* sum;
+
+  static void* operator new(size_t sz) {return mallocOrDie(sz);}
+  ShearTable(const UberCache& uber, int32_t angle);
+};
+
+/* Subdivision search result; see Fragment. */
+struct SubdivisionResult {
+  float best_score;
+  float best_cost;
+  uint32_t best_angle_code;
+  uint32_t best_line;
+  uint32_t best_num_lines;
+  int32_t best_distance;
+  uint32_t left_rows;
+  uint32_t right_rows;
+};
+
+/*
+ * Subdivision search results shared by all variants.
+ *
+ * Region is identified by the path of splits from the root; search result
+ * depends only on region, angle bits of its level and line limit. Thus,
+ * variants that differ in deeper level parameters or color options reuse the
+ * top of the tree. Only regions not deeper than "maxDepth" are tracked.
+ */
+class SubdivisionCache {
+ public:
+  static constexpr uint32_t kNone = 0;
+  static constexpr uint32_t kRoot = 1;
+
+  static void* operator new(size_t sz) {return mallocOrDie(sz);}
+  explicit SubdivisionCache(uint32_t maxDepth) : maxDepth(maxDepth) {
+    depth.push_back(0);  // kNone
+    depth.push_back(0);  // kRoot
+  }
+
+  /* Returns key of child region of accepted subdivision, or kNone. */
+  uint32_t child(const CodecParams& cp, const Fragment& parent, bool left);
+  /* Fills search result, if it is known. */
+  bool find(const CodecParams& cp, Fragment* f);
+  void store(const CodecParams& cp, const Fragment& f);
+
+ private:
+  static constexpr uint32_t kMaxRegions = 1u << 22;
+
+  const uint32_t maxDepth;
+#if !defined(__wasm__)
+  std::mutex mutex;
+#endif
+  /* parent key, angle, side, distance -> key */
+  std::unordered_map<uint64_t, uint32_t> regions;
+  /* key, angle bits, line limit -> result */
+  std::unordered_map<uint32_t, SubdivisionResult> results;
+  std::vector<uint8_t> depth;
+};
+
 class UberCache {
  public:
   ~UberCache() {
     delete sum;
+    delete sum2;
+    for (size_t i = 0; i < SinCosT::kMaxAngle; ++i) delete shear[i];
+    delete shared;
   }
 
   const uint32_t width;
@@ -24,11 +113,48 @@ class UberCache {
   const uint32_t stride;
   /* Cumulative sums. Extra column with total sum. */
   Vector<int32_t>* sum;
+  /* Cumulative sums of squares; same layout: [r^2, g^2, b^2, 0]. */
+  Vector<int32_t>* sum2;
+  /* Optional; only near-vertical angles could have a table. */
+  ShearTable* shear[SinCosT::kMaxAngle] = {nullptr};
 
   float imageTax;
   float sqeBase = 0.0f;
 
-  explicit UberCache(const Image& src);
+  /* Approximate subdivision search; see Encoder::Params. */
+  uint32_t approxRowStride = 1;
+  uint32_t approxTopK = 0;
+  /* Coarse-to-fine subdivision search; see Encoder::Params. */
+  uint32_t coarseAngleStep = 1;
+  uint32_t coarseSeeds = 0;
+  /* See Encoder::Params. */
+  bool warmPalettes = false;
+  uint32_t parallelSearchRows = 0;
+  uint32_t tilingLevels = 0;
+  /* Optional; see Encoder::Params::sharedSearchDepth. */
+  SubdivisionCache* shared = nullptr;
+  /* Optional; set by Encoder::Encoding::cancel. Simulation stops taking
+     new batches of variants. */
+  const std::atomic<bool>* cancelled = nullptr;
+#if !defined(__wasm__)
+  /* Runs the jobs of the encoding; see Encoder::Params::pool. */
+  ThreadPool* pool = nullptr;
+#endif
+  /* See Encoder::Params. */
+  uint32_t firstWorkerTasks = 0;
+
+  bool isCancelled() const {
+    return cancelled && cancelled->load(std::memory_order_relaxed);
+  }
+
+  UberCache(const Image& src, uint32_t shearTableBits);
+};
+
+/* Subdivision candidate of approximate search. */
+struct SplitCandidate {
+  float score;
+  /* line * angle_max + angle_code */
+  uint32_t code;
 };
 
 class Cache {
@@ -38,8 +164,15 @@ class Cache {
     delete y;
     delete x0;
     delete x1;
-    delete x;
+    delete sweep_next;
+    delete sweep_head;
+    delete sweep_slot;
     delete stats;
+    delete approx_region;
+    delete approx_candidates;
+    delete coarse_seeds;
+    delete split_left;
+    delete split_right;
   }
   const UberCache* uber;
 
@@ -48,8 +181,26 @@ class Cache {
   Vector<float>* y;
   Vector<int32_t>* x0;
   Vector<int32_t>* x1;
-  Vector<int32_t>* x;
+  /* Line sweep: per-row "next" links and per-line list heads (enter, leave);
+     region row <-> active set slot mapping. */
+  Vector<int32_t>* sweep_next;
+  Vector<int32_t>* sweep_head;
+  Vector<int32_t>* sweep_slot;
+  /* Candidates are scored in windows; window holds at least one angle. */
+  static constexpr uint32_t kStatsWindow = 512;
   Vector<float>* stats;
+  /* Approximate search: subsampled region and best candidates; only
+     allocated if approximate search is enabled. */
+  Vector<int32_t>* approx_region;
+  Array<SplitCandidate>* approx_candidates;
+  uint64_t approx_searches = 0;
+  uint64_t approx_mismatches = 0;
+  /* Coarse-to-fine search: best coarse candidates; only allocated if
+     coarse-to-fine search is enabled. */
+  Array<SplitCandidate>* coarse_seeds;
+  /* Subdivision check: children regions before materialization. */
+  Vector<int32_t>* split_left;
+  Vector<int32_t>* split_right;
 
   explicit Cache(const UberCache& uber);
 };
@@ -70,21 +221,35 @@ class Fragment {
   float best_score;
   uint32_t best_num_lines;
   float best_cost;
+  /* Until subdivision search is done, best_score / best_cost are bounds. */
+  bool searched = false;
+  /* Children are materialized only if subdivision is accepted. */
+  int32_t best_distance;
+  uint32_t left_rows;
+  uint32_t right_rows;
+  /* Key in SubdivisionCache; kNone if region is not shared. */
+  uint32_t shared_key = SubdivisionCache::kNone;
 
   Fragment(Fragment&&) = delete;
   Fragment& operator=(Fragment&&) = delete;
   Fragment(const Fragment&) = delete;
   Fragment& operator=(const Fragment&) = delete;
-  ~Fragment() {
-    delete region;
-    delete leftChild;
-    delete rightChild;
+
+  /* Fragments (and their regions) live in arena. */
+  static void* operator new(size_t sz, Arena* arena) {
+    return arena->alloc(sz);
   }
+  static void operator delete(void*, Arena*) {}
 
-  static void* operator new(size_t sz) {return mallocOrDie(sz);}
+  NOINLINE Fragment(Arena* arena, uint32_t height)
+      : region(allocVector<int32_t>(arena, 3 * vecSize(height))) {}
+
+  /* Creates children according to the best subdivision. */
+  void split(Arena* arena, const CodecParams& cp);
 
-  NOINLINE explicit Fragment(uint32_t height)
-      : region(allocVector<int32_t>(3 * vecSize(height))) {}
+  /* Copies subdivision search result; loading marks fragment as searched. */
+  void saveSearch(SubdivisionResult* dst) const;
+  void loadSearch(const SubdivisionResult& src);
 
   void encode(XRangeEncoder* dst, const CodecParams& cp, bool is_leaf,
               const float* RESTRICT palette, Array<Fragment*>* children);
@@ -93,7 +258,19 @@ class Fragment {
 class Partition {
  public:
   static void* operator new(size_t sz) {return mallocOrDie(sz);}
-  Partition(Cache* cache, const CodecParams& cp, size_t targetSize);
+  /*
+   * Partition takes ownership of |arena|; it is expected to be empty.
+   * If |pool| is not nullptr, subdivisions of
+   * the queued fragments are searched ahead by its workers. Tiles of tiled
+   * partition (see Encoder::Params::tilingLevels) are built by |numThreads|.
+   */
+  Partition(Arena* arena, Cache* cache, const CodecParams& cp,
+            size_t targetSize, SearchPool* pool = nullptr,
+            uint32_t numThreads = 1);
+  ~Partition() {
+    delete arena;
+    for (Arena* tileArena : tileArenas) delete tileArena;
+  }
 
   const Array<Fragment*>* getPartition() const;
 
@@ -102,8 +279,14 @@ class Partition {
   uint32_t subpartition(float imageTax, const CodecParams& cp,
                         uint32_t target_size) const;
 
+  /* Returns arena for reuse; Partition becomes unusable. */
+  Arena* releaseArena();
+
  private:
-  Fragment root;
+  Arena* arena;
+  /* Fragments of tiles built by other threads. */
+  std::vector<Arena*> tileArenas;
+  Fragment* root;
   Array<Fragment*> partition;
 };
 
@@ -5,6 +5,7 @@
 #endif  // __wasm__
 
 #include <algorithm>
+#include <cmath>
 
 #include "codec_params.h"
 #include "distance_range.h"
@@ -43,67 +44,95 @@ INLINE void diff(Stats* diff, const Stats& plus, const Stats& minus) {
 #endif
 }
 
-void INLINE updateGeHorizontal(Cache* cache, int32_t d) {
-  constexpr HWY_FULL(float) df;
+/* x where line crosses the row; see DistanceRange for line equations. */
+template <bool kHorizontal, typename VF, typename VI>
+INLINE VI crossX(VF y, VI x0, VI x1, VF m_ny_nx, VF d_n) {
   constexpr HWY_FULL(int32_t) di32;
-
-  int32_t ny = SinCos.kCos[0];
-  float d_ny = d / (float)ny;  // TODO: precalculate
-  size_t count = cache->count;
-  int32_t* RESTRICT row_offset = cache->row_offset->data();
-  float* RESTRICT region_y = cache->y->data();
-  int32_t* RESTRICT region_x0 = cache->x0->data();
-  int32_t* RESTRICT region_x1 = cache->x1->data();
-  int32_t* RESTRICT region_x = cache->x->data();
-
-  const auto k4 = Set(di32, 4);
-  const auto d_ny_ = Set(df, d_ny);
-  for (size_t i = 0; i < count; i += Lanes(df)) {
-    const auto y = Load(df, region_y + i);
-    const auto offset = Load(di32, row_offset + i);
-    const auto x0 = Load(di32, region_x0 + i);
-    const auto x1 = Load(di32, region_x1 + i);
-    const auto selector = RebindMask(di32, y < d_ny_);
-    const auto x = IfThenElse(selector, x1, x0);
-    const auto x_off = k4 * x + offset;
-    Store(x_off, di32, region_x + i);
+  if (kHorizontal) {
+    return IfThenElse(RebindMask(di32, y < d_n), x1, x0);
   }
+  const auto xi = ConvertTo(di32, MulAdd(y, m_ny_nx, d_n));
+  return Min(x1, Max(xi, x0));
 }
 
-INLINE void updateGeGeneric(Cache* cache, int32_t angle, int32_t d) {
+/*
+ * Sums of the uber-cache over cached rows left from |kLines| lines at once;
+ * |base| is added to each result. Lines could belong to different angles:
+ * line k is described by |m_ny_nx[k]| and |d_n[k]| (d / ny for horizontal
+ * lines, d / nx + 0.5 otherwise).
+ *
+ * Rows are processed in tiles: row data is loaded once per tile for all the
+ * lines, and crossing offsets are kept in a small (L1-resident) stack buffer
+ * instead of Cache. Summation of different lines is interleaved, so there
+ * are |kLines| independent dependency chains.
+ */
+template <size_t kLines, bool kHorizontal>
+INLINE void sumLines(const Cache* cache, const float* RESTRICT m_ny_nx,
+                     const float* RESTRICT d_n, const int32_t* RESTRICT base,
+                     Stats* RESTRICT dst) {
   constexpr HWY_FULL(float) df;
   constexpr HWY_FULL(int32_t) di32;
+  // Multiple of any vector size.
+  constexpr size_t kTileRows = 64;
 
-  float m_ny_nx = SinCos.kMinusCot[angle];
-  float d_nx = static_cast<float>(d * SinCos.kInvSin[angle] + 0.5);
-  int32_t* RESTRICT row_offset = cache->row_offset->data();
-  float* RESTRICT region_y = cache->y->data();
-  int32_t* RESTRICT region_x0 = cache->x0->data();
-  int32_t* RESTRICT region_x1 = cache->x1->data();
-  int32_t* RESTRICT region_x = cache->x->data();
+  const size_t count = cache->count;
+  const int32_t* RESTRICT row_offset = cache->row_offset->data();
+  const float* RESTRICT region_y = cache->y->data();
+  const int32_t* RESTRICT region_x0 = cache->x0->data();
+  const int32_t* RESTRICT region_x1 = cache->x1->data();
+  const int32_t* RESTRICT sum = cache->uber->sum->data();
 
   const auto k4 = Set(di32, 4);
-  const auto d_nx_ = Set(df, d_nx);
-  const auto m_ny_nx_ = Set(df, m_ny_nx);
-  const size_t count = cache->count;
-  for (size_t i = 0; i < count; i += Lanes(df)) {
-    const auto y = Load(df, region_y + i);
-    const auto offset = Load(di32, row_offset + i);
-    const auto xf = MulAdd(y, m_ny_nx_, d_nx_);
-    const auto xi = ConvertTo(di32, xf);
-    const auto x0 = Load(di32, region_x0 + i);
-    const auto x1 = Load(di32, region_x1 + i);
-    const auto x = Min(x1, Max(xi, x0));
-    const auto x_off = k4 * x + offset;
-    Store(x_off, di32, region_x + i);
-  }
-}
-
-INLINE void updateGe(Cache* cache, int angle, int d) {
-  if (angle == 0) {
-    updateGeHorizontal(cache, d);
-  } else {
-    updateGeGeneric(cache, angle, d);
+  decltype(Zero(df)) m_[kLines];
+  decltype(Zero(df)) d_[kLines];
+  for (size_t k = 0; k < kLines; ++k) {
+    m_[k] = Set(df, kHorizontal ? 0.0f : m_ny_nx[k]);
+    d_[k] = Set(df, d_n[k]);
+  }
+
+#if HWY_TARGET == HWY_SCALAR
+  int32_t acc[kLines][4];
+  for (size_t k = 0; k < kLines; ++k) {
+    for (size_t j = 0; j < 4; ++j) acc[k][j] = base[j];
+  }
+#else
+  constexpr HWY_CAPPED(float, 4) d4f;
+  constexpr HWY_CAPPED(int32_t, 4) d4;
+  decltype(Zero(d4)) acc[kLines];
+  for (size_t k = 0; k < kLines; ++k) acc[k] = Load(d4, base);
+#endif
+
+  HWY_ALIGN int32_t x_off[kLines][kTileRows];
+  for (size_t tile = 0; tile < count; tile += kTileRows) {
+    const size_t n = std::min(kTileRows, count - tile);
+    for (size_t i = 0; i < n; i += Lanes(df)) {
+      const auto y = Load(df, region_y + tile + i);
+      const auto offset = Load(di32, row_offset + tile + i);
+      const auto x0 = Load(di32, region_x0 + tile + i);
+      const auto x1 = Load(di32, region_x1 + tile + i);
+      for (size_t k = 0; k < kLines; ++k) {
+        const auto x = crossX<kHorizontal>(y, x0, x1, m_[k], d_[k]);
+        Store(k4 * x + offset, di32, x_off[k] + i);
+      }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      for (size_t k = 0; k < kLines; ++k) {
+#if HWY_TARGET == HWY_SCALAR
+        const int32_t* RESTRICT p = sum + x_off[k][i];
+        for (size_t j = 0; j < 4; ++j) acc[k][j] += p[j];
+#else
+        acc[k] = acc[k] + Load(d4, sum + x_off[k][i]);
+#endif
+      }
+    }
+  }
+
+  for (size_t k = 0; k < kLines; ++k) {
+#if HWY_TARGET == HWY_SCALAR
+    for (size_t j = 0; j < 4; ++j) dst[k].values[j] = acc[k][j];
+#else
+    Store(ConvertTo(d4f, acc[k]), d4f, dst[k].values);
+#endif
   }
 }
 
@@ -166,70 +195,57 @@ void score(const Stats& whole, size_t n, const float* RESTRICT r,
   }
 }
 
-/* |length| is for scalar mode; vectorized versions look after the end of
-   input up to complete vector, where "big" fillers have to be placed. */
+/* Index of the first "best" value among |length| values (same as
+   std::min_element / std::max_element). Values must not be NaN. Vectorized
+   versions look after the end of input up to complete vector; those values
+   are ignored. */
 template <typename Op>
 INLINE uint32_t choose(Op op, const float* RESTRICT values, size_t length) {
   constexpr HWY_FULL(float) df;
   constexpr HWY_FULL(int32_t) di32;
 
 #if HWY_TARGET == HWY_SCALAR
-  bool use_scalar = true;
+  return op.scalarChoose(values, length);
 #else
-  // TODO(eustas): could be less, but more workaround code is required.
-  bool use_scalar = true;//(length < Lanes(df));
-#endif
-  if (use_scalar) return op.scalarChoose(values, length);
-
-  constexpr const HWY_FULL(int32_t) kDi32;
   HWY_ALIGN static const int32_t kIotaArray[] = {0, 1, 2,  3,  4,  5,  6,  7,
                                                   8, 9, 10, 11, 12, 13, 14, 15};
-  static const decltype(Zero(kDi32)) kIota = Load(kDi32, kIotaArray);
-  static const decltype(Zero(kDi32)) kStep = Set(kDi32, static_cast<int32_t>(Lanes(kDi32)));
-
-  auto limit = Set(di32, static_cast<uint32_t>(length));
-  auto idx = kIota;
-  auto bestIdx = idx;
-  auto bestValue = Load(df, values);
+  const auto kStep = Set(di32, static_cast<int32_t>(Lanes(di32)));
+  const auto limit = Set(di32, static_cast<int32_t>(length));
+
+  // Each lane keeps the first best value among its elements; comparison is
+  // strict, so later equal values do not win. Lanes past the end start
+  // with element 0.
+  auto idx = Load(di32, kIotaArray);
+  auto in_range = idx < limit;
+  auto bestIdx = IfThenElseZero(in_range, idx);
+  auto bestValue = IfThenElse(RebindMask(df, in_range), Load(df, values),
+                              Set(df, values[0]));
   for (size_t i = Lanes(df); i < length; i += Lanes(df)) {
     idx = idx + kStep;
     const auto value = Load(df, values + i);
-    const auto selector = And(op.select(value, bestValue), RebindMask(df, idx < limit));
+    const auto selector =
+        And(op.select(value, bestValue), RebindMask(df, idx < limit));
     bestValue = IfThenElse(selector, value, bestValue);
     bestIdx = IfThenElse(RebindMask(di32, selector), idx, bestIdx);
   }
 
-#if HWY_TARGET == HWY_AVX3
-  {
-    const auto winnerValue = op.reduce(bestValue);
-    return GetLane(Compress(bestIdx, RebindMask(di32, bestValue == winnerValue)));
-  }
-#elif HWY_TARGET == HWY_AVX2
-  {
-    const auto shuffledIdx = ConcatLowerUpper(bestIdx, bestIdx);
-    const auto shuffledValue = ConcatLowerUpper(bestValue, bestValue);
-    const auto selector = op.select(shuffledValue, bestValue);
-    bestValue = IfThenElse(selector, shuffledValue, bestValue);
-    bestIdx = IfThenElse(RebindMask(di32, selector), shuffledIdx, bestIdx);
-  }
-#endif
-#if HWY_TARGET != HWY_SCALAR
-  {
-    const auto shuffledIdx = Shuffle1032(bestIdx);
-    const auto shuffledValue = Shuffle1032(bestValue);
-    const auto selector = op.select(shuffledValue, bestValue);
-    bestValue = IfThenElse(selector, shuffledValue, bestValue);
-    bestIdx = IfThenElse(RebindMask(di32, selector), shuffledIdx, bestIdx);
-  }
-  {
-    const auto shuffledIdx = Shuffle0321(bestIdx);
-    const auto shuffledValue = Shuffle0321(bestValue);
-    const auto selector = op.select(shuffledValue, bestValue);
-    // bestValue = IfThenElse(selector, shuffledValue, bestValue);
-    bestIdx = IfThenElse(RebindMask(di32, selector), shuffledIdx, bestIdx);
+  // Across lanes: best value wins; equal values are resolved by index.
+  HWY_ALIGN float lane_value[16];
+  HWY_ALIGN int32_t lane_idx[16];
+  Store(bestValue, df, lane_value);
+  Store(bestIdx, di32, lane_idx);
+  float best_value = lane_value[0];
+  int32_t best_idx = lane_idx[0];
+  for (size_t j = 1; j < Lanes(df); ++j) {
+    float value = lane_value[j];
+    if (op.scalarSelect(value, best_value) ||
+        ((value == best_value) && (lane_idx[j] < best_idx))) {
+      best_value = value;
+      best_idx = lane_idx[j];
+    }
   }
+  return static_cast<uint32_t>(best_idx);
 #endif
-  return GetLane(bestIdx);
 }
 
 struct OpMin {
@@ -237,10 +253,7 @@ struct OpMin {
   INLINE auto select(T a, T b) -> decltype(a < b) {
     return a < b;
   }
-  template <typename T>
-  INLINE auto reduce(T v) -> T {
-    return MinOfLanes(v);
-  }
+  INLINE bool scalarSelect(float a, float b) { return a < b; }
   INLINE uint32_t scalarChoose(const float* RESTRICT values, size_t length) {
     return std::distance(values, std::min_element(values, values + length));
   }
@@ -255,10 +268,7 @@ struct OpMax {
   INLINE auto select(T a, T b) -> decltype(a > b) {
     return a > b;
   }
-  template <typename T>
-  INLINE auto reduce(T v) -> T {
-    return MaxOfLanes(v);
-  }
+  INLINE bool scalarSelect(float a, float b) { return a > b; }
   INLINE uint32_t scalarChoose(const float* RESTRICT values, size_t length) {
     return std::distance(values, std::max_element(values, values + length));
   }
@@ -295,9 +305,97 @@ NOINLINE uint32_t chooseColor(float r, float g, float b,
   return best;
 }
 
+/*
+ * Lowers |nearest| squared distances from |n| colors to the (r, g, b) center;
+ * same arithmetic as in chooseColor.
+ */
+INLINE void updateNearest(float r, float g, float b,
+                          const float* RESTRICT colors_r,
+                          const float* RESTRICT colors_g,
+                          const float* RESTRICT colors_b, uint32_t n,
+                          bool first, float* RESTRICT nearest) {
+  constexpr HWY_FULL(float) df;
+  const auto pr = Set(df, r);
+  const auto pg = Set(df, g);
+  const auto pb = Set(df, b);
+  for (size_t i = 0; i < n; i += Lanes(df)) {
+    const auto dr = Load(df, colors_r + i) - pr;
+    const auto dg = Load(df, colors_g + i) - pg;
+    const auto db = Load(df, colors_b + i) - pb;
+    const auto d2 = dr * dr + dg * dg + db * db;
+    Store(first ? d2 : Min(d2, Load(df, nearest + i)), df, nearest + i);
+  }
+}
+
+/*
+ * Finds the nearest center (the first one on ties) for the colors of a
+ * block of lanes; squared distances are the same as in chooseColor. Also
+ * stores the squared distance to the second nearest center.
+ */
+INLINE void assignBlock(const float* RESTRICT colors_r,
+                        const float* RESTRICT colors_g,
+                        const float* RESTRICT colors_b,
+                        const float* RESTRICT centers_r,
+                        const float* RESTRICT centers_g,
+                        const float* RESTRICT centers_b, uint32_t m,
+                        int32_t* RESTRICT index, float* RESTRICT distance2,
+                        float* RESTRICT second_distance2) {
+  constexpr HWY_FULL(float) df;
+  constexpr HWY_FULL(int32_t) di32;
+  const auto r = Load(df, colors_r);
+  const auto g = Load(df, colors_g);
+  const auto b = Load(df, colors_b);
+  auto best_idx = Zero(di32);
+  auto best = Zero(df);
+  auto second = Set(df, 1e35f);
+  for (uint32_t j = 0; j < m; ++j) {
+    const auto dr = r - Set(df, centers_r[j]);
+    const auto dg = g - Set(df, centers_g[j]);
+    const auto db = b - Set(df, centers_b[j]);
+    const auto d2 = dr * dr + dg * dg + db * db;
+    if (j == 0) {
+      best = d2;
+      continue;
+    }
+    const auto closer = d2 < best;
+    second = IfThenElse(closer, best, Min(second, d2));
+    best = IfThenElse(closer, d2, best);
+    best_idx = IfThenElse(RebindMask(di32, closer),
+                          Set(di32, static_cast<int32_t>(j)), best_idx);
+  }
+  Store(best_idx, di32, index);
+  Store(best, df, distance2);
+  Store(second, df, second_distance2);
+}
+
+/* Squared distances from the colors of a block of lanes to given centers. */
+INLINE void measureBlock(const float* RESTRICT colors_r,
+                         const float* RESTRICT colors_g,
+                         const float* RESTRICT colors_b,
+                         const float* RESTRICT centers_r,
+                         const float* RESTRICT centers_g,
+                         const float* RESTRICT centers_b,
+                         const int32_t* RESTRICT index,
+                         float* RESTRICT distance2) {
+  constexpr HWY_FULL(float) df;
+  HWY_ALIGN float tmp_r[16];
+  HWY_ALIGN float tmp_g[16];
+  HWY_ALIGN float tmp_b[16];
+  for (size_t k = 0; k < Lanes(df); ++k) {
+    tmp_r[k] = centers_r[index[k]];
+    tmp_g[k] = centers_g[index[k]];
+    tmp_b[k] = centers_b[index[k]];
+  }
+  const auto dr = Load(df, colors_r) - Load(df, tmp_r);
+  const auto dg = Load(df, colors_g) - Load(df, tmp_g);
+  const auto db = Load(df, colors_b) - Load(df, tmp_b);
+  Store(dr * dr + dg * dg + db * db, df, distance2);
+}
+
 INLINE void makePalette(const float* stats, float* RESTRICT palette,
-                        float* RESTRICT storage, uint32_t num_patches,
-                        uint32_t palette_size) {
+                        float* RESTRICT storage, int32_t* RESTRICT assignment,
+                        uint32_t num_patches, uint32_t palette_size,
+                        const Vector<float>* seed) {
   constexpr HWY_FULL(float) df;
   constexpr HWY_FULL(int32_t) di32;
 
@@ -312,7 +410,19 @@ INLINE void makePalette(const float* stats, float* RESTRICT palette,
   float* RESTRICT centers_acc_g = storage + 1 * centers_step;
   float* RESTRICT centers_acc_b = storage + 2 * centers_step;
   float* RESTRICT centers_acc_c = storage + 3 * centers_step;
-  float* RESTRICT weights = storage + 0 * centers_step;
+  float* RESTRICT old_r = storage + 4 * centers_step;
+  float* RESTRICT old_g = storage + 5 * centers_step;
+  float* RESTRICT old_b = storage + 6 * centers_step;
+  /* Half of the distance to the nearest other center. */
+  float* RESTRICT half_gap = storage + 7 * centers_step;
+  float* RESTRICT patch_storage = storage + 8 * centers_step;
+  // Seeding and Lloyd's iterations share the per-patch arrays, so those are
+  // not RESTRICT.
+  float* weights = patch_storage + 0 * stats_step;
+  float* nearest = patch_storage + 1 * stats_step;
+  float* distance2 = patch_storage + 0 * stats_step;
+  /* Lower bound of the distance to the second nearest center. */
+  float* lower = patch_storage + 1 * stats_step;
   const float* RESTRICT stats_r = stats + 0 * stats_step;
   const float* RESTRICT stats_g = stats + 1 * stats_step;
   const float* RESTRICT stats_b = stats + 2 * stats_step;
@@ -325,7 +435,17 @@ INLINE void makePalette(const float* stats, float* RESTRICT palette,
 
   uint32_t random = 0x23DE605F;
 
-  {
+  uint32_t num_seeds = (seed != nullptr) ? std::min(seed->len, m) : 0;
+  if (num_seeds > 0) {
+    // Take over the centers of the (smaller) seed palette.
+    const size_t seed_step = vecSize(seed->len);
+    const float* RESTRICT seed_r = seed->data();
+    for (uint32_t j = 0; j < num_seeds; ++j) {
+      centers_r[j] = seed_r[j];
+      centers_g[j] = seed_r[seed_step + j];
+      centers_b[j] = seed_r[2 * seed_step + j];
+    }
+  } else {
     // Choose one center uniformly at random from among the data points.
     float total = 0.0f;
     uint32_t i;
@@ -341,19 +461,22 @@ INLINE void makePalette(const float* stats, float* RESTRICT palette,
     centers_r[0] = stats_r[i];
     centers_g[0] = stats_g[i];
     centers_b[0] = stats_b[i];
+    num_seeds = 1;
+  }
+
+  // D(x) is the distance to the nearest center; it is the same as in
+  // chooseColor, but each center is visited only once.
+  for (uint32_t j = 0; j < num_seeds; ++j) {
+    updateNearest(centers_r[j], centers_g[j], centers_b[j], stats_r, stats_g,
+                  stats_b, n, j == 0, nearest);
   }
 
-  // Warning: O(MN)
-  for (uint32_t j = 1; j < m; ++j) {
-    // D(x) is the distance to the nearest center.
+  for (uint32_t j = num_seeds; j < m; ++j) {
     // Choose next with probability proportional to D(x)^2.
     uint32_t i;
     float total = 0.0f;
     for (i = 0; i < n; ++i) {
-      float distance;
-      chooseColor(stats_r[i], stats_g[i], stats_b[i], centers_r, centers_g,
-                  centers_b, j, &distance);
-      float weight = distance * stats_c[i];
+      float weight = nearest[i] * stats_c[i];
       weights[i] = weight;
       total += weight;
     }
@@ -374,10 +497,43 @@ INLINE void makePalette(const float* stats, float* RESTRICT palette,
     centers_r[j] = stats_r[i];
     centers_g[j] = stats_g[i];
     centers_b[j] = stats_b[i];
+    if (j + 1 < m) {
+      updateNearest(centers_r[j], centers_g[j], centers_b[j], stats_r,
+                    stats_g, stats_b, n, false, nearest);
+    }
   }
 
+  // Lloyd's algorithm. Assignment is the same as with chooseColor, but
+  // most of the patches skip the search (Hamerly's bounds): the nearest
+  // center stays the same, if it is closer than the bound of the second
+  // nearest one, or than the half of the gap to the other centers. Bounds
+  // are kept with a margin that covers the rounding errors.
+  constexpr float kMargin = 1.0f / 16.0f;
+  const size_t step = Lanes(df);
   float last_score = 1e35f;
+  float max_move = 0.0f;
+  bool first = true;
   while (true) {
+    for (size_t i = 0; i < n; i += step) {
+      if (!first) {
+        measureBlock(stats_r + i, stats_g + i, stats_b + i, centers_r,
+                     centers_g, centers_b, assignment + i, distance2 + i);
+        bool keep = true;
+        for (size_t k = i; k < std::min<size_t>(i + step, n); ++k) {
+          lower[k] -= max_move;
+          float bound = std::max(half_gap[assignment[k]], lower[k]);
+          if (std::sqrt(distance2[k]) + kMargin >= bound) keep = false;
+        }
+        if (keep) continue;
+      }
+      HWY_ALIGN float second[16];
+      assignBlock(stats_r + i, stats_g + i, stats_b + i, centers_r,
+                  centers_g, centers_b, m, assignment + i, distance2 + i,
+                  second);
+      for (size_t k = 0; k < step; ++k) lower[i + k] = std::sqrt(second[k]);
+    }
+    first = false;
+
     for (size_t j = 0; j < m; j += Lanes(df)) {
       Store(k0, df, centers_acc_r + j);
       Store(k0, df, centers_acc_g + j);
@@ -386,17 +542,18 @@ INLINE void makePalette(const float* stats, float* RESTRICT palette,
     }
     float score = 0.0f;
     for (size_t i = 0; i < n; ++i) {
-      float d2;
-      uint32_t index = chooseColor(stats_r[i], stats_g[i], stats_b[i],
-                                   centers_r, centers_g, centers_b, m, &d2);
+      uint32_t index = assignment[i];
       float c = stats_c[i];
-      score += d2 * c;
+      score += distance2[i] * c;
       centers_acc_r[index] += stats_wr[i];
       centers_acc_g[index] += stats_wg[i];
       centers_acc_b[index] += stats_wb[i];
       centers_acc_c[index] += c;
     }
     for (size_t j = 0; j < m; j += Lanes(df)) {
+      Store(Load(df, centers_r + j), df, old_r + j);
+      Store(Load(df, centers_g + j), df, old_g + j);
+      Store(Load(df, centers_b + j), df, old_b + j);
       const auto c = Load(df, centers_acc_c + j);
       const auto inv_c = kOne / Max(c, kOne);
       Store(Load(df, centers_acc_r + j) * inv_c, df, centers_r + j);
@@ -406,6 +563,24 @@ INLINE void makePalette(const float* stats, float* RESTRICT palette,
     // if (score != score) break; // TODO(eustas): is NaN possible?
     if (last_score - score < 1.0f) break;
     last_score = score;
+
+    // Warning: O(M^2), but M is small.
+    max_move = 0.0f;
+    for (uint32_t j = 0; j < m; ++j) {
+      float dr = centers_r[j] - old_r[j];
+      float dg = centers_g[j] - old_g[j];
+      float db = centers_b[j] - old_b[j];
+      max_move = std::max(max_move, std::sqrt(dr * dr + dg * dg + db * db));
+      float gap2 = 1e35f;
+      for (uint32_t k = 0; k < m; ++k) {
+        if (k == j) continue;
+        dr = centers_r[j] - centers_r[k];
+        dg = centers_g[j] - centers_g[k];
+        db = centers_b[j] - centers_b[k];
+        gap2 = std::min(gap2, dr * dr + dg * dg + db * db);
+      }
+      half_gap[j] = 0.5f * std::sqrt(gap2);
+    }
   }
 
   // Round the pallete values.
@@ -423,32 +598,38 @@ INLINE void makePalette(const float* stats, float* RESTRICT palette,
   }
 }
 
-NOINLINE Vector<float>* buildPalette(
-    const Vector<float>* patches, uint32_t palette_size) {
+NOINLINE Vector<float>* buildPalette(const Vector<float>* patches,
+                                     uint32_t palette_size,
+                                     const Vector<float>* seed) {
   uint32_t n = patches->len;
   uint32_t m = palette_size;
   uint32_t padded_m = vecSize(m);
   uint32_t palette_space = 3 * padded_m;
-  uint32_t extra_space = std::max(4 * padded_m, ((m > 0) ? n : 1));
+  // 8 rows per center, 2 rows per patch.
+  uint32_t extra_space = 8 * padded_m + 2 * vecSize(n);
   Vector<float>* result = allocVector<float>((m > 0) ? palette_space : 1);
-  Vector<float>* extra = allocVector<float>(extra_space);
 
   result->len = m;
-  if (m > 0) makePalette(patches->data(), result->data(), extra->data(), n, m);
-  delete extra;
+  if (m > 0) {
+    Vector<float>* extra = allocVector<float>(extra_space);
+    Vector<int32_t>* assignment = allocVector<int32_t>(vecSize(n));
+    makePalette(patches->data(), result->data(), extra->data(),
+                assignment->data(), n, m, seed);
+    delete extra;
+    delete assignment;
+  }
 
   return result;
 }
 
-NOINLINE Vector<float>* gatherPatches(const Array<Fragment*>* partition,
-                                      uint32_t num_non_leaf) {
+NOINLINE Vector<float>* gatherChildren(const Array<Fragment*>* partition,
+                                       uint32_t max_non_leaf) {
   constexpr HWY_FULL(float) df;
   const auto kOne = Set(df, 1.0f);
 
-  /* In a binary tree the number of leaves is number of nodes plus one. */
-  uint32_t n = num_non_leaf + 1;
+  uint32_t n = 2 * max_non_leaf;
   uint32_t stats_size = vecSize(n);
-  Vector<float>* result = allocVector<float>(7 * stats_size);
+  Vector<float>* result = allocVector<float>(8 * stats_size);
   float* RESTRICT stats = result->data();
   float* RESTRICT stats_r = stats + 0 * stats_size;
   float* RESTRICT stats_g = stats + 1 * stats_size;
@@ -457,16 +638,18 @@ NOINLINE Vector<float>* gatherPatches(const Array<Fragment*>* partition,
   float* RESTRICT stats_wr = stats + 4 * stats_size;
   float* RESTRICT stats_wg = stats + 5 * stats_size;
   float* RESTRICT stats_wb = stats + 6 * stats_size;
+  float* RESTRICT ordinal = stats + 7 * stats_size;
 
   size_t pos = 0;
-  for (size_t i = 0; i < num_non_leaf; ++i) {
+  for (size_t i = 0; i < max_non_leaf; ++i) {
     Fragment* node = partition->data[i];
-    for (Fragment* leaf : {node->leftChild, node->rightChild}) {
-      if (leaf->ordinal < num_non_leaf) continue;
-      stats_wr[pos] = leaf->stats[0];
-      stats_wg[pos] = leaf->stats[1];
-      stats_wb[pos] = leaf->stats[2];
-      stats_c[pos] = leaf->stats[3];
+    for (Fragment* child : {node->leftChild, node->rightChild}) {
+      stats_wr[pos] = child->stats[0];
+      stats_wg[pos] = child->stats[1];
+      stats_wb[pos] = child->stats[2];
+      stats_c[pos] = child->stats[3];
+      // Exact: partition is way smaller than 2^24 nodes.
+      ordinal[pos] = static_cast<float>(child->ordinal);
       pos++;
     }
   }
@@ -486,27 +669,42 @@ NOINLINE Vector<float>* gatherPatches(const Array<Fragment*>* partition,
   return result;
 }
 
-float simulateEncode(float imageTax, const Partition& partition_holder,
-                     uint32_t target_size, const CodecParams& cp) {
-  uint32_t num_non_leaf =
-      partition_holder.subpartition(imageTax, cp, target_size);
-  if (num_non_leaf <= 1) {
-    // Let's deal with a flat image separately.
-    return 1e35f;
-  }
-  // TODO(eustas): why patches storage is not cached?
-  Vector<float>* patches =
-      gatherPatches(partition_holder.getPartition(), num_non_leaf);
-  size_t patches_step = patches->capacity / 7;
-  float* RESTRICT stats = patches->data();
-  float* RESTRICT patches_r = stats + 0 * patches_step;
-  float* RESTRICT patches_g = stats + 1 * patches_step;
-  float* RESTRICT patches_b = stats + 2 * patches_step;
-  float* RESTRICT patches_c = stats + 3 * patches_step;
+NOINLINE void selectPatches(const Vector<float>* children,
+                            uint32_t num_non_leaf, Vector<float>* patches) {
+  const size_t children_step = vecSize(children->len);
+  const float* RESTRICT src = children->data();
+  const float* RESTRICT ordinal = src + 7 * children_step;
+  /* In a binary tree the number of leaves is number of nodes plus one. */
+  uint32_t n = num_non_leaf + 1;
+  const size_t stats_step = vecSize(n);
+  float* RESTRICT dst = patches->data();
+  // Children of the first nodes come first.
+  const size_t limit = 2 * num_non_leaf;
+  const float threshold = static_cast<float>(num_non_leaf);
+
+  size_t pos = 0;
+  for (size_t i = 0; i < limit; ++i) {
+    if (ordinal[i] < threshold) continue;
+    for (size_t j = 0; j < 7; ++j) {
+      dst[j * stats_step + pos] = src[j * children_step + i];
+    }
+    pos++;
+  }
 
+  patches->len = n;
+}
+
+float simulateEncode(const Vector<float>* patches,
+                     const Vector<float>* palette, const CodecParams& cp) {
   size_t n = patches->len;
+  size_t patches_step = vecSize(n);
+  const float* RESTRICT stats = patches->data();
+  const float* RESTRICT patches_r = stats + 0 * patches_step;
+  const float* RESTRICT patches_g = stats + 1 * patches_step;
+  const float* RESTRICT patches_b = stats + 2 * patches_step;
+  const float* RESTRICT patches_c = stats + 3 * patches_step;
+
   const uint32_t m = cp.palette_size;
-  Vector<float>* palette = buildPalette(patches, m);
   const float* RESTRICT palette_r = palette->data();
   const size_t palette_step = vecSize(m);
   const float* RESTRICT palette_g = palette_r + palette_step;
@@ -526,32 +724,40 @@ float simulateEncode(float imageTax, const Partition& partition_holder,
   const float quant = v_max / 255.0f;
   const float dequant = 255.0f / ((v_max != 0) ? v_max : 1);
 
-  for (size_t i = 0; i < n; ++i) {
-    float orig[3] = {patches_r[i], patches_g[i], patches_b[i]};
-    float rgb[3] = {orig[0], orig[1], orig[2]};
-    float c = patches_c[i];
-    // Lambdas were nice, but are fatty in WASM.
-    if (m == 0) {
+  // Palette colors are chosen for a block of lanes at once.
+  constexpr HWY_FULL(float) df;
+  const size_t step = Lanes(df);
+  HWY_ALIGN int32_t index[16];
+  HWY_ALIGN float distance2[16];
+  HWY_ALIGN float second[16];
+  for (size_t i0 = 0; i0 < n; i0 += step) {
+    if (m > 0) {
+      assignBlock(patches_r + i0, patches_g + i0, patches_b + i0, palette_r,
+                  palette_g, palette_b, m, index, distance2, second);
+    }
+    for (size_t i = i0; i < std::min(i0 + step, n); ++i) {
+      float orig[3] = {patches_r[i], patches_g[i], patches_b[i]};
+      float rgb[3] = {orig[0], orig[1], orig[2]};
+      float c = patches_c[i];
+      // Lambdas were nice, but are fatty in WASM.
+      if (m == 0) {
+        for (size_t j = 0; j < 3; ++j) {
+          int32_t quantized = static_cast<int32_t>(rgb[j] * quant + 0.5f);
+          // TODO(eustas): investigate how to use floorf
+          rgb[j] = std::floor(quantized * dequant);
+        }
+      } else {
+        uint32_t k = index[i - i0];
+        rgb[0] = palette_r[k];
+        rgb[1] = palette_g[k];
+        rgb[2] = palette_b[k];
+      }
       for (size_t j = 0; j < 3; ++j) {
-        int32_t quantized = static_cast<int32_t>(rgb[j] * quant + 0.5f);
-        // TODO(eustas): investigate how to use floorf
-        rgb[j] = std::floor(quantized * dequant);
+        // TODO(eustas): could use non-normalized patch color.
+        result += c * rgb[j] * (rgb[j] - 2.0f * orig[j]);
       }
-    } else {
-      float dummy;
-      uint32_t index = chooseColor(rgb[0], rgb[1], rgb[2], palette_r, palette_g,
-                                   palette_b, m, &dummy);
-      rgb[0] = palette_r[index];
-      rgb[1] = palette_g[index];
-      rgb[2] = palette_b[index];
-    }
-    for (size_t j = 0; j < 3; ++j) {
-      // TODO(eustas): could use non-normalized patch color.
-      result += c * rgb[j] * (rgb[j] - 2.0f * orig[j]);
     }
   }
-  delete patches;
-  delete palette;
 
   return result;
 }
@@ -583,46 +789,14 @@ void sumCache(const Cache* c, const int32_t* RESTRICT region_x, Stats* dst) {
 #endif
 }
 
-INLINE void sumCacheAbs(const Cache* c, const int32_t* RESTRICT region_x,
-                        Stats* dst) {
-  size_t count = c->count;
-  const int32_t* RESTRICT sum = c->uber->sum->data();
-
-#if HWY_TARGET == HWY_SCALAR
-  int32_t tmp[4] = {0};
-  for (size_t i = 0; i < count; i++) {
-    int32_t offset = region_x[i];
-    tmp[0] += sum[offset + 0];
-    tmp[1] += sum[offset + 1];
-    tmp[2] += sum[offset + 2];
-    tmp[3] += sum[offset + 3];
-  }
-  for (size_t j = 0; j < 4; ++j) dst->values[j] = tmp[j];
-#else
-  constexpr HWY_CAPPED(float, 4) df;
-  constexpr HWY_CAPPED(int32_t, 4) di32;
-  auto tmp1 = Load(di32, sum + region_x[0]);
-  auto tmp2 = Load(di32, sum + region_x[1]);
-  auto tmp3 = Load(di32, sum + region_x[2]);
-  auto tmp4 = Load(di32, sum + region_x[3]);
-  for (size_t i = 4; i < count; i += 4) {
-    tmp1 = tmp1 + Load(di32, sum + region_x[i + 0]);
-    tmp2 = tmp2 + Load(di32, sum + region_x[i + 1]);
-    tmp3 = tmp3 + Load(di32, sum + region_x[i + 2]);
-    tmp4 = tmp4 + Load(di32, sum + region_x[i + 3]);
-  }
-  Store(ConvertTo(df, (tmp1 + tmp2) + (tmp3 + tmp4)), df, dst->values);
-#endif
-}
-
-void INLINE prepareCache(Cache* c, Vector<int32_t>* region) {
+void INLINE prepareCache(Cache* c, const Vector<int32_t>* region) {
   constexpr HWY_FULL(float) df;
   const size_t kStrideMask = Lanes(df) - 1;
 
   uint32_t count = region->len;
   uint32_t step = region->capacity / 3;
   uint32_t sum_stride = c->uber->stride;
-  int32_t* RESTRICT data = region->data();
+  const int32_t* RESTRICT data = region->data();
   float* RESTRICT y = c->y->data();
   int32_t* RESTRICT x0 = c->x0->data();
   int32_t* RESTRICT x1 = c->x1->data();
@@ -644,76 +818,909 @@ void INLINE prepareCache(Cache* c, Vector<int32_t>* region) {
   c->count = count;
 }
 
-void findBestSubdivision(Fragment* f, Cache* cache, const CodecParams& cp) {
-  Vector<int32_t>& region = *f->region;
-  Stats stats;
-  Stats plus;
-  Stats minus;
-  float* stats_ = cache->stats->data();
-  size_t stats_step = vecSize(CodecParams::kMaxLineLimit * SinCos.kMaxAngle);
-  float* RESTRICT stats_r = stats_ + 0 * stats_step;
-  float* RESTRICT stats_g = stats_ + 1 * stats_step;
-  float* RESTRICT stats_b = stats_ + 2 * stats_step;
-  float* RESTRICT stats_c = stats_ + 3 * stats_step;
-  float* RESTRICT stats_s = stats_ + 4 * stats_step;
-  uint32_t* RESTRICT stats_v =
-      reinterpret_cast<uint32_t*>(stats_ + 5 * stats_step);
-  uint32_t level = cp.getLevel(region);
-  // TODO(eustas): assert(level != CodecParams::kInvalid)
-  uint32_t angle_max = 1u << cp.angle_bits[level];
-  uint32_t angle_mult = (SinCos.kMaxAngle / angle_max);
-  prepareCache(cache, &region);
-  sumCache(cache, cache->x1->data(), &plus);
-  sumCache(cache, cache->x0->data(), &minus);
-  diff(&stats, plus, minus);
-  for (size_t i = 0; i < 4; ++i) f->stats[i] = stats.values[i];
+/* |d_n| argument of sumLines for a given line. */
+INLINE float lineDN(int32_t angle, int32_t d) {
+  if (angle == 0) return d / static_cast<float>(SinCos.kCos[0]);
+  return static_cast<float>(d * SinCos.kInvSin[angle] + 0.5);
+}
+
+/* Left-side statistics for candidate |index|. */
+INLINE void storeLeft(const Stats& plus, const Stats& minus, size_t index,
+                      float* RESTRICT stats_r, float* RESTRICT stats_g,
+                      float* RESTRICT stats_b, float* RESTRICT stats_c) {
+  Stats left;
+  diff(&left, plus, minus);
+  stats_r[index] = left.values[0];
+  stats_g[index] = left.values[1];
+  stats_b[index] = left.values[2];
+  stats_c[index] = left.values[3];
+}
+
+/* Non-horizontal full rescan lines; batched across angles. */
+struct LineBatch {
+  static constexpr size_t kSize = 4;
+  size_t count = 0;
+  float m_ny_nx[kSize];
+  float d_nx[kSize];
+  size_t index[kSize];
+};
+
+/* Evaluates the pending lines of |batch| over prepared cache. */
+INLINE void flushLines(const Cache* cache, LineBatch* batch,
+                       const Stats& plus, float* RESTRICT stats_r,
+                       float* RESTRICT stats_g, float* RESTRICT stats_b,
+                       float* RESTRICT stats_c) {
+  HWY_ALIGN static const int32_t kZero[4] = {0};
+  const size_t count = batch->count;
+  if (count == 0) return;
+  // Pad with copies of the last line; results are ignored.
+  for (size_t k = count; k < LineBatch::kSize; ++k) {
+    batch->m_ny_nx[k] = batch->m_ny_nx[count - 1];
+    batch->d_nx[k] = batch->d_nx[count - 1];
+  }
+  Stats minus[LineBatch::kSize];
+  sumLines<LineBatch::kSize, false>(cache, batch->m_ny_nx, batch->d_nx, kZero,
+                                    minus);
+  for (size_t k = 0; k < count; ++k) {
+    storeLeft(plus, minus[k], batch->index[k], stats_r, stats_g, stats_b,
+              stats_c);
+  }
+  batch->count = 0;
+}
+
+/*
+ * Full rescan of the (prepared) cache for each line of a single angle.
+ * Horizontal lines are evaluated right away, others are queued to |batch|.
+ * Results are stored starting from |first|.
+ */
+INLINE void scanLines(const Cache* cache, int32_t angle,
+                      DistanceRange* distance_range, const Stats& plus,
+                      size_t first, LineBatch* batch, float* RESTRICT stats_r,
+                      float* RESTRICT stats_g, float* RESTRICT stats_b,
+                      float* RESTRICT stats_c) {
+  HWY_ALIGN static const int32_t kZero[4] = {0};
+  constexpr size_t kSize = LineBatch::kSize;
+  const uint32_t num_lines = distance_range->num_lines;
+  if (angle != 0) {
+    const float m_ny_nx = SinCos.kMinusCot[angle];
+    for (uint32_t line = 0; line < num_lines; ++line) {
+      size_t k = batch->count++;
+      batch->m_ny_nx[k] = m_ny_nx;
+      batch->d_nx[k] = lineDN(angle, distance_range->distance(line));
+      batch->index[k] = first + line;
+      if (batch->count == kSize) {
+        flushLines(cache, batch, plus, stats_r, stats_g, stats_b, stats_c);
+      }
+    }
+    return;
+  }
+  for (uint32_t line = 0; line < num_lines; line += kSize) {
+    float d_ny[kSize];
+    size_t n = std::min<size_t>(kSize, num_lines - line);
+    for (size_t k = 0; k < kSize; ++k) {
+      uint32_t d = distance_range->distance(line + std::min(k, n - 1));
+      d_ny[k] = lineDN(angle, d);
+    }
+    Stats minus[kSize];
+    sumLines<kSize, true>(cache, nullptr, d_ny, kZero, minus);
+    for (size_t k = 0; k < n; ++k) {
+      storeLeft(plus, minus[k], first + line + k, stats_r, stats_g, stats_b,
+                stats_c);
+    }
+  }
+}
+
+/*
+ * Line sweep over all the lines of a single angle.
+ *
+ * While line moves (in distance order), each row goes through 3 states:
+ * "low" (x <= x0), "active" (x0 < x < x1) and "high" (x >= x1); transitions
+ * are monotonic. Only active rows are fed to sumLines; low and high rows are
+ * accounted in |low| and |high| sums. Lines of transitions are estimated
+ * conservatively: row is put to the active set a bit earlier, and removed
+ * from it a bit later, than it actually changes state; clamping in sumLines
+ * produces correct x for such rows anyway. Sums are integer, so
+ * results are exactly the same as of full rescan for each line.
+ *
+ * Cache y / x0 / x1 / row_offset are reused for the active set.
+ */
+INLINE void sweepLines(Cache* cache, const Vector<int32_t>& region,
+                       int32_t angle, DistanceRange* distance_range,
+                       const Stats& plus, float* RESTRICT stats_r,
+                       float* RESTRICT stats_g, float* RESTRICT stats_b,
+                       float* RESTRICT stats_c) {
+  constexpr HWY_FULL(float) df;
+  const size_t kStrideMask = Lanes(df) - 1;
+
+  const uint32_t num_lines = distance_range->num_lines;
+  const size_t region_count = region.len;
+  const size_t region_step = region.capacity / 3;
+  const int32_t* RESTRICT region_y = region.data();
+  const int32_t* RESTRICT region_x0 = region_y + region_step;
+  const int32_t* RESTRICT region_x1 = region_x0 + region_step;
+  const int32_t sum_stride = cache->uber->stride;
+  const int32_t* RESTRICT sum = cache->uber->sum->data();
+
+  float* RESTRICT y = cache->y->data();
+  int32_t* RESTRICT x0 = cache->x0->data();
+  int32_t* RESTRICT x1 = cache->x1->data();
+  int32_t* RESTRICT row_offset = cache->row_offset->data();
+  const size_t list_step = cache->sweep_next->capacity / 2;
+  int32_t* RESTRICT enter_next = cache->sweep_next->data();
+  int32_t* RESTRICT leave_next = enter_next + list_step;
+  const size_t head_step = cache->sweep_head->capacity / 2;
+  int32_t* RESTRICT enter_head = cache->sweep_head->data();
+  int32_t* RESTRICT leave_head = enter_head + head_step;
+  int32_t* RESTRICT slot = cache->sweep_slot->data();
+  int32_t* RESTRICT slot_row = slot + list_step;
+
+  // Line distances are d(line) = start + line * quant; could be negative.
+  double start = static_cast<int32_t>(distance_range->distance(0));
+  double quant = (num_lines > 1)
+      ? (static_cast<int32_t>(distance_range->distance(1)) - start) : 1.0;
+  double inv_quant = 1.0 / quant;
+  // Tolerance (in pixels) to absorb float rounding in sumLines.
+  constexpr double kMargin = 2.0;
+  double nx = SinCos.kSin[angle];
+  double ny = SinCos.kCos[angle];
+  double m_ny_nx = SinCos.kMinusCot[angle];
+  const float m_ny_nx_f = SinCos.kMinusCot[angle];
+
+  HWY_ALIGN int32_t low[4] = {0};
+  HWY_ALIGN int32_t high[4] = {0};
+  HWY_ALIGN int32_t base[4];
+  size_t count = 0;
+  for (uint32_t line = 0; line < num_lines; ++line) {
+    enter_head[line] = -1;
+    leave_head[line] = -1;
+  }
+  for (size_t i = 0; i < region_count; ++i) {
+    int32_t row_y = region_y[i];
+    int32_t row_x0 = region_x0[i];
+    int32_t row_x1 = region_x1[i];
+    const int32_t* RESTRICT row_sum = sum + row_y * sum_stride;
+    // Lines, where row could leave "low" state / is sure to be "high".
+    double enter = 0.0;
+    double leave = num_lines;
+    if (num_lines > 1) {
+      double enter_d;
+      double leave_d;
+      if (angle == 0) {
+        // x = (y < d / ny) ? x1 : x0
+        enter_d = (row_y - kMargin) * ny;
+        leave_d = (row_y + kMargin) * ny;
+      } else {
+        // x = d / nx + 0.5 - y * ny / nx
+        enter_d = (row_x0 + 0.5 - kMargin - row_y * m_ny_nx) * nx;
+        leave_d = (row_x1 - 0.5 + kMargin - row_y * m_ny_nx) * nx;
+      }
+      enter = (enter_d - start) * inv_quant;
+      leave = (leave_d - start) * inv_quant + 1.0;
+    }
+    if (leave < 1.0) {
+      for (size_t j = 0; j < 4; ++j) high[j] += row_sum[4 * row_x1 + j];
+      continue;
+    }
+    if (leave < num_lines) {
+      uint32_t line = static_cast<uint32_t>(leave);
+      leave_next[i] = leave_head[line];
+      leave_head[line] = static_cast<int32_t>(i);
+    }
+    if (enter < 1.0) {
+      slot[i] = static_cast<int32_t>(count);
+      slot_row[count] = static_cast<int32_t>(i);
+      y[count] = row_y;
+      x0[count] = row_x0;
+      x1[count] = row_x1;
+      row_offset[count] = row_y * sum_stride;
+      count++;
+      continue;
+    }
+    for (size_t j = 0; j < 4; ++j) low[j] += row_sum[4 * row_x0 + j];
+    if (enter < num_lines) {
+      uint32_t line = static_cast<uint32_t>(enter);
+      enter_next[i] = enter_head[line];
+      enter_head[line] = static_cast<int32_t>(i);
+    }
+  }
+
+  for (uint32_t line = 0; line < num_lines; ++line) {
+    for (int32_t i = enter_head[line]; i >= 0; i = enter_next[i]) {
+      int32_t row_y = region_y[i];
+      const int32_t* RESTRICT p = sum + row_y * sum_stride + 4 * region_x0[i];
+      for (size_t j = 0; j < 4; ++j) low[j] -= p[j];
+      slot[i] = static_cast<int32_t>(count);
+      slot_row[count] = i;
+      y[count] = row_y;
+      x0[count] = region_x0[i];
+      x1[count] = region_x1[i];
+      row_offset[count] = row_y * sum_stride;
+      count++;
+    }
+    for (int32_t i = leave_head[line]; i >= 0; i = leave_next[i]) {
+      const int32_t* RESTRICT p =
+          sum + region_y[i] * sum_stride + 4 * region_x1[i];
+      for (size_t j = 0; j < 4; ++j) high[j] += p[j];
+      // Swap-remove from the active set.
+      int32_t s = slot[i];
+      int32_t last = static_cast<int32_t>(--count);
+      int32_t moved = slot_row[last];
+      slot[moved] = s;
+      slot_row[s] = moved;
+      y[s] = y[last];
+      x0[s] = x0[last];
+      x1[s] = x1[last];
+      row_offset[s] = row_offset[last];
+    }
+    // Padding rows produce zero offset; zero column of sum is all zeroes.
+    size_t padded_count = count;
+    while ((padded_count & kStrideMask) != 0) {
+      y[padded_count] = 0;
+      x0[padded_count] = 0;
+      x1[padded_count] = 0;
+      row_offset[padded_count] = 0;
+      padded_count++;
+    }
+    cache->count = static_cast<uint32_t>(padded_count);
+    for (size_t j = 0; j < 4; ++j) base[j] = low[j] + high[j];
+    float d_n = lineDN(angle, distance_range->distance(line));
+    Stats minus;
+    if (angle == 0) {
+      sumLines<1, true>(cache, nullptr, &d_n, base, &minus);
+    } else {
+      sumLines<1, false>(cache, &m_ny_nx_f, &d_n, base, &minus);
+    }
+    storeLeft(plus, minus, line, stats_r, stats_g, stats_b, stats_c);
+  }
+}
+
+/*
+ * Same as sweepLines, but lines are rasterized as in |table|, which makes
+ * the whole "active" (mid) range sum just a couple of lookups.
+ */
+INLINE void sweepLinesShear(Cache* cache, const ShearTable& table,
+                            const Vector<int32_t>& region, int32_t angle,
+                            DistanceRange* distance_range, const Stats& plus,
+                            float* RESTRICT stats_r, float* RESTRICT stats_g,
+                            float* RESTRICT stats_b, float* RESTRICT stats_c) {
+  const uint32_t num_lines = distance_range->num_lines;
+  const int32_t region_count = static_cast<int32_t>(region.len);
+  const size_t region_step = region.capacity / 3;
+  const int32_t* RESTRICT region_y = region.data();
+  const int32_t* RESTRICT region_x0 = region_y + region_step;
+  const int32_t* RESTRICT region_x1 = region_x0 + region_step;
+  const int32_t sum_stride = cache->uber->stride;
+  const int32_t* RESTRICT sum = cache->uber->sum->data();
+  const int32_t* RESTRICT shift = table.shift->data();
+  const int32_t* RESTRICT table_sum = table.sum->data();
+  const size_t table_stride = table.stride;
+
+  const size_t list_step = cache->sweep_next->capacity / 2;
+  int32_t* RESTRICT enter_next = cache->sweep_next->data();
+  int32_t* RESTRICT leave_next = enter_next + list_step;
+  const size_t head_step = cache->sweep_head->capacity / 2;
+  int32_t* RESTRICT enter_head = cache->sweep_head->data();
+  int32_t* RESTRICT leave_head = enter_head + head_step;
+  int32_t* RESTRICT is_mid = cache->sweep_slot->data();
+
+  // Line crosses row y at x = c + shift[y].
+  int32_t line_c[CodecParams::kMaxLineLimit];
+  double inv_nx = SinCos.kInvSin[angle];
+  for (uint32_t line = 0; line < num_lines; ++line) {
+    int32_t d = static_cast<int32_t>(distance_range->distance(line));
+    line_c[line] = static_cast<int32_t>(std::floor(d * inv_nx + 0.5));
+    enter_head[line] = -1;
+    leave_head[line] = -1;
+  }
+
+  HWY_ALIGN int32_t low[4] = {0};
+  HWY_ALIGN int32_t high[4] = {0};
+  int32_t mid_count = 0;
+  int32_t mid_first = region_count;
+  int32_t mid_last = -1;
+  for (int32_t i = 0; i < region_count; ++i) {
+    int32_t row_shift = shift[region_y[i]];
+    const int32_t* RESTRICT row_sum = sum + region_y[i] * sum_stride;
+    // Row is "low" while c <= x0 - shift, "high" since c >= x1 - shift.
+    uint32_t enter = static_cast<uint32_t>(
+        std::lower_bound(line_c, line_c + num_lines,
+                         region_x0[i] - row_shift + 1) - line_c);
+    uint32_t leave = static_cast<uint32_t>(
+        std::lower_bound(line_c, line_c + num_lines,
+                         region_x1[i] - row_shift) - line_c);
+    is_mid[i] = 0;
+    if (leave == 0) {
+      for (size_t j = 0; j < 4; ++j) high[j] += row_sum[4 * region_x1[i] + j];
+      continue;
+    }
+    if (leave < num_lines) {
+      leave_next[i] = leave_head[leave];
+      leave_head[leave] = i;
+    }
+    if (enter == 0) {
+      is_mid[i] = 1;
+      mid_count++;
+      mid_first = std::min(mid_first, i);
+      mid_last = std::max(mid_last, i);
+      continue;
+    }
+    for (size_t j = 0; j < 4; ++j) low[j] += row_sum[4 * region_x0[i] + j];
+    if (enter < num_lines) {
+      enter_next[i] = enter_head[enter];
+      enter_head[enter] = i;
+    }
+  }
 
+  for (uint32_t line = 0; line < num_lines; ++line) {
+    for (int32_t i = enter_head[line]; i >= 0; i = enter_next[i]) {
+      const int32_t* RESTRICT p =
+          sum + region_y[i] * sum_stride + 4 * region_x0[i];
+      for (size_t j = 0; j < 4; ++j) low[j] -= p[j];
+      is_mid[i] = 1;
+      mid_count++;
+      mid_first = std::min(mid_first, i);
+      mid_last = std::max(mid_last, i);
+    }
+    for (int32_t i = leave_head[line]; i >= 0; i = leave_next[i]) {
+      const int32_t* RESTRICT p =
+          sum + region_y[i] * sum_stride + 4 * region_x1[i];
+      for (size_t j = 0; j < 4; ++j) high[j] += p[j];
+      is_mid[i] = 0;
+      mid_count--;
+      // Bounds stay valid, but might become loose.
+      if (i == mid_first) mid_first++;
+      if (i == mid_last) mid_last--;
+    }
+    if (mid_count == 0) {
+      mid_first = region_count;
+      mid_last = -1;
+    }
+
+    int32_t c = line_c[line];
+    HWY_ALIGN int32_t total[4];
+    for (size_t j = 0; j < 4; ++j) total[j] = low[j] + high[j];
+    if (mid_count > 0) {
+      int32_t y0 = region_y[mid_first];
+      int32_t y1 = region_y[mid_last];
+      if ((mid_last - mid_first + 1 == mid_count) &&
+          (y1 - y0 == mid_last - mid_first)) {
+        // Contiguous range of rows.
+        size_t offset = 4 * (c - table.c_min);
+        const int32_t* RESTRICT plus_row =
+            table_sum + (y1 + 1) * table_stride + offset;
+        const int32_t* RESTRICT minus_row =
+            table_sum + y0 * table_stride + offset;
+        for (size_t j = 0; j < 4; ++j) total[j] += plus_row[j] - minus_row[j];
+      } else {
+        for (int32_t i = mid_first; i <= mid_last; ++i) {
+          if (!is_mid[i]) continue;
+          int32_t row_y = region_y[i];
+          const int32_t* RESTRICT p =
+              sum + row_y * sum_stride + 4 * (c + shift[row_y]);
+          for (size_t j = 0; j < 4; ++j) total[j] += p[j];
+        }
+      }
+    }
+    Stats minus;
+    for (size_t j = 0; j < 4; ++j) minus.values[j] = total[j];
+    Stats left;
+    diff(&left, plus, minus);
+    stats_r[line] = left.values[0];
+    stats_g[line] = left.values[1];
+    stats_b[line] = left.values[2];
+    stats_c[line] = left.values[3];
+  }
+}
+
+/* Sweep setup costs about the same as a few rescans; not worth it for small
+   fragments. */
+constexpr const uint32_t kMinSweepLines = 16;
+
+static_assert(Cache::kStatsWindow >= CodecParams::kMaxLineLimit,
+              "stats window should fit all lines of an angle");
+
+/* Approximate search is used only if subsampled region has enough rows. */
+constexpr const uint32_t kMinApproxRows = 16;
+
+/* Candidate statistics storage; see Cache::stats. */
+struct Window {
+  explicit Window(const Cache* cache) {
+    float* stats = cache->stats->data();
+    size_t step = vecSize(Cache::kStatsWindow);
+    r = stats + 0 * step;
+    g = stats + 1 * step;
+    b = stats + 2 * step;
+    c = stats + 3 * step;
+    s = stats + 4 * step;
+    v = reinterpret_cast<uint32_t*>(stats + 5 * step);
+  }
+
+  float* r;
+  float* g;
+  float* b;
+  float* c;
+  float* s;
+  /* line * angle_max + angle_code */
+  uint32_t* v;
+};
+
+/*
+ * Drops candidates [0, |num_candidates|) that produce empty region and
+ * scores the rest. Returns the number of remaining candidates.
+ */
+INLINE size_t scoreWindow(const Stats& whole, size_t num_candidates,
+                          const Window& w) {
+  float* RESTRICT stats_r = w.r;
+  float* RESTRICT stats_g = w.g;
+  float* RESTRICT stats_b = w.b;
+  float* RESTRICT stats_c = w.c;
+  uint32_t* RESTRICT stats_v = w.v;
+  float min_c = 0.5f;
+  float max_c = whole.values[3] - 0.5f;
   size_t num_subdivisions = 0;
+  for (size_t i = 0; i < num_candidates; ++i) {
+    float c = stats_c[i];
+    if ((c > min_c) && (c < max_c)) {
+      stats_r[num_subdivisions] = stats_r[i];
+      stats_g[num_subdivisions] = stats_g[i];
+      stats_b[num_subdivisions] = stats_b[i];
+      stats_c[num_subdivisions] = c;
+      stats_v[num_subdivisions] = stats_v[i];
+      num_subdivisions++;
+    }
+  }
+  if (num_subdivisions == 0) return 0;
+
+  size_t padded = num_subdivisions;
+  uint32_t step = vecSize(1);
+  while ((padded % step) != 0) {
+    stats_r[padded] = stats_r[padded - 1];
+    stats_g[padded] = stats_g[padded - 1];
+    stats_b[padded] = stats_b[padded - 1];
+    stats_c[padded] = stats_c[padded - 1];
+    padded++;
+  }
+  score(whole, padded, stats_r, stats_g, stats_b, stats_c, w.s);
+  return num_subdivisions;
+}
+
+/*
+ * Keeps the best candidate. Only strictly better candidates replace it, so
+ * the result is the same as of scoring all candidates at once.
+ */
+struct ExactSink {
+  bool found = false;
+  float score = 0.0f;
+  uint32_t code = 0;
+
+  INLINE void consume(const Stats& whole, size_t num_candidates,
+                      const Window& w) {
+    size_t n = scoreWindow(whole, num_candidates, w);
+    if (n == 0) return;
+    uint32_t index = chooseMax(w.s, n);
+    if (!found || w.s[index] > score) {
+      found = true;
+      score = w.s[index];
+      code = w.v[index];
+    }
+  }
+};
+
+/*
+ * Collects |top_k| best candidates. Candidates that produce empty region
+ * (e.g. with subsampled rows) are not dropped, but get the lowest score.
+ */
+/* Scores the window and pushes all its candidates; invalid ones get -1. */
+template <typename Sink>
+INLINE void pushWindow(Sink* sink, const Stats& whole, size_t num_candidates,
+                       const Window& w) {
   float min_c = 0.5f;
-  float max_c = stats.values[3] - 0.5f;
+  float max_c = whole.values[3] - 0.5f;
+  for (size_t i = 0; i < num_candidates; ++i) {
+    float c = w.c[i];
+    if (!((c > min_c) && (c < max_c))) sink->push(-1.0f, w.v[i]);
+  }
+  size_t n = scoreWindow(whole, num_candidates, w);
+  for (size_t i = 0; i < n; ++i) sink->push(w.s[i], w.v[i]);
+}
+
+struct TopKSink {
+  Array<SplitCandidate>* candidates;
+  size_t top_k;
+  uint32_t angle_max;
+
+  /* Position of candidate in evaluation order. */
+  INLINE uint32_t order(uint32_t code) const {
+    return (code % angle_max) * 64 + code / angle_max;
+  }
+
+  INLINE bool better(const SplitCandidate& a, const SplitCandidate& b) const {
+    if (a.score != b.score) return a.score > b.score;
+    return order(a.code) < order(b.code);
+  }
+
+  INLINE void keepTopK() {
+    SplitCandidate* data = candidates->data;
+    if (candidates->size <= top_k) return;
+    std::nth_element(data, data + top_k, data + candidates->size,
+                     [this](const SplitCandidate& a, const SplitCandidate& b) {
+                       return better(a, b);
+                     });
+    candidates->size = top_k;
+  }
+
+  INLINE void push(float score, uint32_t code) {
+    if (candidates->size == candidates->capacity) keepTopK();
+    candidates->data[candidates->size++] = {score, code};
+  }
+
+  INLINE void consume(const Stats& whole, size_t num_candidates,
+                      const Window& w) {
+    pushWindow(this, whole, num_candidates, w);
+  }
+};
+
+/* Keeps the best candidate of each angle. */
+struct AngleBestSink {
+  const TopKSink* order;
+  SplitCandidate best[SinCosT::kMaxAngle];
+  uint8_t found[SinCosT::kMaxAngle] = {0};
+
+  INLINE void push(float score, uint32_t code) {
+    uint32_t angle_code = code % order->angle_max;
+    SplitCandidate candidate = {score, code};
+    if (!found[angle_code] || order->better(candidate, best[angle_code])) {
+      best[angle_code] = candidate;
+      found[angle_code] = 1;
+    }
+  }
 
-  // Find subdivision
+  INLINE void consume(const Stats& whole, size_t num_candidates,
+                      const Window& w) {
+    pushWindow(this, whole, num_candidates, w);
+  }
+};
+
+/*
+ * Evaluates all candidate lines over |rows| and feeds them to |sink| window
+ * by window. |rows| is either |region| itself, or its subset; in any case
+ * lines are chosen for the whole |region|. If |angle_mask| is not nullptr,
+ * only angles with non-zero mask are evaluated. Cache should be prepared for
+ * |rows|; it is clobbered by the evaluation.
+ */
+template <typename Sink>
+INLINE void evaluateCandidates(Cache* cache, const Vector<int32_t>& region,
+                               const Vector<int32_t>& rows,
+                               const CodecParams& cp, uint32_t level,
+                               const Stats& whole, const Stats& plus,
+                               const uint8_t* angle_mask, Sink* sink) {
+  const Window w(cache);
+  uint32_t angle_max = 1u << cp.angle_bits[level];
+  uint32_t angle_mult = (SinCos.kMaxAngle / angle_max);
+  size_t num_candidates = 0;
+  bool cache_prepared = true;
+  LineBatch batch;
   for (uint32_t angle_code = 0; angle_code < angle_max; ++angle_code) {
+    if (angle_mask && !angle_mask[angle_code]) continue;
     int32_t angle = angle_code * angle_mult;
     DistanceRange distance_range(region, angle, cp);
     uint32_t num_lines = distance_range.num_lines;
+    if (num_candidates + num_lines > Cache::kStatsWindow) {
+      flushLines(cache, &batch, plus, w.r, w.g, w.b, w.c);
+      sink->consume(whole, num_candidates, w);
+      num_candidates = 0;
+    }
+    size_t first = num_candidates;
+    num_candidates += num_lines;
     for (uint32_t line = 0; line < num_lines; ++line) {
-      updateGe(cache, angle, distance_range.distance(line));
-      sumCacheAbs(cache, cache->x->data(), &minus);
-      Stats left;
-      diff(&left, plus, minus);
-      stats_r[num_subdivisions] = left.values[0];
-      stats_g[num_subdivisions] = left.values[1];
-      stats_b[num_subdivisions] = left.values[2];
-      stats_c[num_subdivisions] = left.values[3];
-      stats_v[num_subdivisions] = line * angle_max + angle_code;
-      float c = left.values[3];
-      num_subdivisions += ((c > min_c) && (c < max_c)) ? 1 : 0;
+      w.v[first + line] = line * angle_max + angle_code;
+    }
+    const ShearTable* shear = cache->uber->shear[angle];
+    if (shear && num_lines >= kMinSweepLines) {
+      sweepLinesShear(cache, *shear, rows, angle, &distance_range, plus,
+                      w.r + first, w.g + first, w.b + first, w.c + first);
+    } else if (num_lines >= kMinSweepLines) {
+      // Sweep reuses cache for the active set.
+      flushLines(cache, &batch, plus, w.r, w.g, w.b, w.c);
+      sweepLines(cache, rows, angle, &distance_range, plus, w.r + first,
+                 w.g + first, w.b + first, w.c + first);
+      cache_prepared = false;
+    } else {
+      if (!cache_prepared) prepareCache(cache, &rows);
+      cache_prepared = true;
+      scanLines(cache, angle, &distance_range, plus, first, &batch, w.r, w.g,
+                w.b, w.c);
     }
   }
+  flushLines(cache, &batch, plus, w.r, w.g, w.b, w.c);
+  sink->consume(whole, num_candidates, w);
+}
 
-  if (num_subdivisions == 0) {
+/*
+ * Exact evaluation of |candidates| sorted in evaluation order. Cache should
+ * be prepared for |region|.
+ */
+template <typename Sink>
+INLINE void evaluateListed(Cache* cache, const Vector<int32_t>& region,
+                           const CodecParams& cp, uint32_t angle_max,
+                           const SplitCandidate* candidates, size_t n,
+                           const Stats& whole, const Stats& plus, Sink* sink) {
+  HWY_ALIGN static const int32_t kZero[4] = {0};
+  const Window w(cache);
+  uint32_t angle_mult = (SinCos.kMaxAngle / angle_max);
+  size_t num_candidates = 0;
+  LineBatch batch;
+  for (size_t i = 0; i < n;) {
+    uint32_t angle_code = candidates[i].code % angle_max;
+    int32_t angle = angle_code * angle_mult;
+    DistanceRange distance_range(region, angle, cp);
+    for (; (i < n) && (candidates[i].code % angle_max == angle_code); ++i) {
+      if (num_candidates == Cache::kStatsWindow) {
+        flushLines(cache, &batch, plus, w.r, w.g, w.b, w.c);
+        sink->consume(whole, num_candidates, w);
+        num_candidates = 0;
+      }
+      uint32_t code = candidates[i].code;
+      size_t index = num_candidates++;
+      w.v[index] = code;
+      float d_n = lineDN(angle, distance_range.distance(code / angle_max));
+      if (angle == 0) {
+        Stats minus;
+        sumLines<1, true>(cache, nullptr, &d_n, kZero, &minus);
+        storeLeft(plus, minus, index, w.r, w.g, w.b, w.c);
+        continue;
+      }
+      size_t k = batch.count++;
+      batch.m_ny_nx[k] = SinCos.kMinusCot[angle];
+      batch.d_nx[k] = d_n;
+      batch.index[k] = index;
+      if (batch.count == LineBatch::kSize) {
+        flushLines(cache, &batch, plus, w.r, w.g, w.b, w.c);
+      }
+    }
+  }
+  flushLines(cache, &batch, plus, w.r, w.g, w.b, w.c);
+  sink->consume(whole, num_candidates, w);
+}
+
+/*
+ * Scores candidates using every n-th row of |region|, then re-evaluates the
+ * best of them exactly. Cache should be prepared for |region|; it is
+ * prepared for |region| on return as well.
+ */
+INLINE void approxSubdivision(Cache* cache, Vector<int32_t>* region,
+                              const CodecParams& cp, uint32_t level,
+                              const Stats& whole, const Stats& plus,
+                              ExactSink* sink) {
+  const uint32_t stride = cache->uber->approxRowStride;
+  const size_t count = region->len;
+  const size_t step = region->capacity / 3;
+  const int32_t* RESTRICT src = region->data();
+  Vector<int32_t>* rows = cache->approx_region;
+  const size_t rows_step = rows->capacity / 3;
+  int32_t* RESTRICT dst = rows->data();
+  size_t num_rows = 0;
+  for (size_t i = 0; i < count; i += stride) {
+    dst[num_rows] = src[i];
+    dst[rows_step + num_rows] = src[step + i];
+    dst[2 * rows_step + num_rows] = src[2 * step + i];
+    num_rows++;
+  }
+  rows->len = static_cast<uint32_t>(num_rows);
+
+  Stats rows_plus;
+  Stats rows_minus;
+  Stats rows_whole;
+  prepareCache(cache, rows);
+  sumCache(cache, cache->x1->data(), &rows_plus);
+  sumCache(cache, cache->x0->data(), &rows_minus);
+  diff(&rows_whole, rows_plus, rows_minus);
+
+  TopKSink approx;
+  approx.candidates = cache->approx_candidates;
+  approx.candidates->size = 0;
+  approx.top_k = cache->uber->approxTopK;
+  approx.angle_max = 1u << cp.angle_bits[level];
+  evaluateCandidates(cache, *region, *rows, cp, level, rows_whole, rows_plus,
+                     nullptr, &approx);
+  approx.keepTopK();
+  SplitCandidate* candidates = approx.candidates->data;
+  size_t n = approx.candidates->size;
+  prepareCache(cache, region);
+  if (n == 0) return;
+  SplitCandidate* approx_best = std::min_element(
+      candidates, candidates + n,
+      [&approx](const SplitCandidate& a, const SplitCandidate& b) {
+        return approx.better(a, b);
+      });
+  uint32_t approx_code = approx_best->code;
+  std::sort(candidates, candidates + n,
+            [&approx](const SplitCandidate& a, const SplitCandidate& b) {
+              return approx.order(a.code) < approx.order(b.code);
+            });
+
+  evaluateListed(cache, *region, cp, approx.angle_max, candidates, n, whole,
+                 plus, sink);
+  cache->approx_searches++;
+  if (!sink->found || sink->code != approx_code) cache->approx_mismatches++;
+}
+
+/*
+ * Evaluates lines of every n-th angle, then lines of all the angles around
+ * the best of those angles (closer than n). Angles are ranked by their best
+ * line, so that seeds are separate local maxima rather than neighbouring
+ * lines of the same angle. Cache should be prepared for |region|; it is
+ * clobbered.
+ */
+INLINE void coarseToFineSubdivision(Cache* cache, Vector<int32_t>* region,
+                                          const CodecParams& cp, uint32_t level,
+                                    const Stats& whole, const Stats& plus,
+                                    ExactSink* sink) {
+  const uint32_t angle_max = 1u << cp.angle_bits[level];
+  const uint32_t angle_step =
+      std::min(cache->uber->coarseAngleStep, angle_max);
+  uint8_t angle_mask[SinCosT::kMaxAngle];
+  for (uint32_t angle_code = 0; angle_code < angle_max; ++angle_code) {
+    angle_mask[angle_code] = ((angle_code % angle_step) == 0) ? 1 : 0;
+  }
+  TopKSink seeds;
+  seeds.candidates = cache->coarse_seeds;
+  seeds.candidates->size = 0;
+  seeds.top_k = cache->uber->coarseSeeds;
+  seeds.angle_max = angle_max;
+  AngleBestSink per_angle;
+  per_angle.order = &seeds;
+  evaluateCandidates(cache, *region, *region, cp, level, whole, plus,
+                     angle_mask, &per_angle);
+  for (uint32_t angle_code = 0; angle_code < angle_max; ++angle_code) {
+    if (!per_angle.found[angle_code]) continue;
+    const SplitCandidate& best = per_angle.best[angle_code];
+    seeds.push(best.score, best.code);
+  }
+  seeds.keepTopK();
+
+  for (uint32_t angle_code = 0; angle_code < angle_max; ++angle_code) {
+    angle_mask[angle_code] = 0;
+  }
+  for (size_t i = 0; i < seeds.candidates->size; ++i) {
+    uint32_t seed_angle = seeds.candidates->data[i].code % angle_max;
+    // Angles wrap around.
+    for (uint32_t delta = 1; delta < 2 * angle_step; ++delta) {
+      uint32_t angle_code = (seed_angle + angle_max + delta - angle_step);
+      angle_mask[angle_code % angle_max] = 1;
+    }
+  }
+  prepareCache(cache, region);
+  evaluateCandidates(cache, *region, *region, cp, level, whole, plus,
+                     angle_mask, sink);
+}
+
+/*
+ * Calculates |plus| (sums to the left of region rows ends) and |whole| region
+ * stats. Returns the upper bound of the split scores: any split gain is not
+ * greater than the sum of squared errors of the region. Scores are calculated
+ * with floats; the bound is widened to cover rounding (sums are rounded to
+ * 24 bits, averages are off by a few ulps). Cache should be prepared for the
+ * region.
+ */
+INLINE float measureRegion(const Cache* c, Stats* plus, Stats* whole) {
+  // Row sum of squares is less than 2048 * 255^2; sum of 16 rows still fits.
+  constexpr size_t kFlushRows = 16;
+  size_t count = c->count;
+  const int32_t* RESTRICT row_offset = c->row_offset->data();
+  const int32_t* RESTRICT x0 = c->x0->data();
+  const int32_t* RESTRICT x1 = c->x1->data();
+  const int32_t* RESTRICT sum = c->uber->sum->data();
+  const int32_t* RESTRICT sum2 = c->uber->sum2->data();
+
+  HWY_ALIGN int32_t sum_plus[4] = {0};
+  HWY_ALIGN int32_t sum_minus[4] = {0};
+  HWY_ALIGN int32_t partial2[4] = {0};
+  int64_t sum_whole2[3] = {0};
+#if HWY_TARGET != HWY_SCALAR
+  constexpr HWY_CAPPED(int32_t, 4) di32;
+  auto acc_plus = Zero(di32);
+  auto acc_minus = Zero(di32);
+#endif
+  for (size_t start = 0; start < count; start += kFlushRows) {
+    size_t end = std::min(count, start + kFlushRows);
+#if HWY_TARGET == HWY_SCALAR
+    for (size_t j = 0; j < 3; ++j) partial2[j] = 0;
+    for (size_t i = start; i < end; i++) {
+      int32_t offset0 = row_offset[i] + 4 * x0[i];
+      int32_t offset1 = row_offset[i] + 4 * x1[i];
+      for (size_t j = 0; j < 4; ++j) {
+        sum_plus[j] += sum[offset1 + j];
+        sum_minus[j] += sum[offset0 + j];
+      }
+      for (size_t j = 0; j < 3; ++j) {
+        partial2[j] += sum2[offset1 + j] - sum2[offset0 + j];
+      }
+    }
+#else
+    auto acc2 = Zero(di32);
+    for (size_t i = start; i < end; i++) {
+      int32_t offset0 = row_offset[i] + 4 * x0[i];
+      int32_t offset1 = row_offset[i] + 4 * x1[i];
+      acc_plus = acc_plus + Load(di32, sum + offset1);
+      acc_minus = acc_minus + Load(di32, sum + offset0);
+      acc2 = acc2 + (Load(di32, sum2 + offset1) - Load(di32, sum2 + offset0));
+    }
+    Store(acc2, di32, partial2);
+#endif
+    for (size_t j = 0; j < 3; ++j) sum_whole2[j] += partial2[j];
+  }
+#if HWY_TARGET != HWY_SCALAR
+  Store(acc_plus, di32, sum_plus);
+  Store(acc_minus, di32, sum_minus);
+#endif
+  // Same as sumCache + diff.
+  for (size_t j = 0; j < 4; ++j) {
+    plus->values[j] = static_cast<float>(sum_plus[j]);
+    whole->values[j] =
+        plus->values[j] - static_cast<float>(sum_minus[j]);
+  }
+  int32_t n = sum_plus[3] - sum_minus[3];
+  if (n == 0) return 0.0f;
+
+  double sqe = 0.0;
+  double max_plus = 0.0;
+  for (size_t j = 0; j < 3; ++j) {
+    double s = static_cast<double>(sum_plus[j] - sum_minus[j]);
+    sqe += static_cast<double>(sum_whole2[j]) - s * s / n;
+    max_plus = std::max(max_plus, static_cast<double>(sum_plus[j]));
+  }
+  sqe = std::max(0.0, sqe);
+  double noise = std::sqrt(6.0) * std::ldexp(max_plus, -22) +
+                 std::sqrt(3.0 * n) * std::ldexp(255.0, -20);
+  double bound = std::sqrt(sqe) + noise;
+  return static_cast<float>(bound * bound * (1.0 + std::ldexp(1.0, -16)));
+}
+
+/* Lower bound of subdivision cost; num_lines is at least 1. */
+INLINE float costBound(const CodecParams& cp, uint32_t level) {
+  return SinCos.kLog2[NodeType::COUNT] + cp.angle_bits[level];
+}
+
+void measureFragment(Fragment* f, Cache* cache, const CodecParams& cp) {
+  uint32_t level = cp.getLevel(*f->region);
+  Stats stats;
+  Stats plus;
+  prepareCache(cache, f->region);
+  float bound = measureRegion(cache, &plus, &stats);
+  for (size_t i = 0; i < 4; ++i) f->stats[i] = stats.values[i];
+  f->level = level;
+  // Near-uniform fragment: no split could reach the threshold used in
+  // findBestSubdivision; search is skipped.
+  if (bound < 0.5f) {
+    f->searched = true;
+    f->best_score = -1.0f;
+    f->best_cost = -1.0f;
+    return;
+  }
+  f->best_score = bound;
+  f->best_cost = costBound(cp, level);
+}
+
+/* Fills fragment subdivision with the |best| candidate. */
+INLINE void applyBest(Fragment* f, Cache* cache, const CodecParams& cp,
+                      const ExactSink& best) {
+  Vector<int32_t>& region = *f->region;
+  uint32_t level = f->level;
+  uint32_t angle_max = 1u << cp.angle_bits[level];
+  uint32_t angle_mult = (SinCos.kMaxAngle / angle_max);
+  f->searched = true;
+
+  if (!best.found) {
     f->best_cost = -1.0f;
     f->best_score = -1.0f;
     return;
   }
 
-  uint32_t step = vecSize(1);
-  while ((num_subdivisions % step) != 0) {
-    stats_r[num_subdivisions] = stats_r[num_subdivisions - 1];
-    stats_g[num_subdivisions] = stats_g[num_subdivisions - 1];
-    stats_b[num_subdivisions] = stats_b[num_subdivisions - 1];
-    stats_c[num_subdivisions] = stats_c[num_subdivisions - 1];
-    stats_v[num_subdivisions] = stats_v[num_subdivisions - 1];
-    num_subdivisions++;
-  }
-  score(stats, num_subdivisions, stats_r, stats_g, stats_b, stats_c, stats_s);
-  uint32_t index = chooseMax(stats_s, num_subdivisions);
-  uint32_t best_angle_code = stats_v[index] % angle_max;
-  uint32_t best_line = stats_v[index] / angle_max;
-  float best_score = stats_s[index];
+  uint32_t best_angle_code = best.code % angle_max;
+  uint32_t best_line = best.code / angle_max;
+  float best_score = best.score;
 
-  f->level = level;
   f->best_score = best_score;
 
   if (best_score < 0.5f) {
@@ -722,19 +1729,19 @@ void findBestSubdivision(Fragment* f, Cache* cache, const CodecParams& cp) {
     // TODO(eustas): why not unreachable?
   } else {
     DistanceRange distance_range(region, best_angle_code * angle_mult, cp);
-    f->leftChild = new Fragment(region.len);
-    f->rightChild = new Fragment(region.len);
-    Region::splitLine(region, best_angle_code * angle_mult,
-                      distance_range.distance(best_line),
-                      f->leftChild->region,
-                      f->rightChild->region);
+    int32_t best_distance = distance_range.distance(best_line);
+    Region::splitLine(region, best_angle_code * angle_mult, best_distance,
+                      cache->split_left, cache->split_right);
     // Check that precise splitting does not produce empty region.
-    if (f->leftChild->region->len == 0 || f->rightChild->region->len == 0) {
+    if (cache->split_left->len == 0 || cache->split_right->len == 0) {
       f->best_score = -1.0f;
       f->best_cost = -1.0f;
       return;
     }
 
+    f->best_distance = best_distance;
+    f->left_rows = cache->split_left->len;
+    f->right_rows = cache->split_right->len;
     f->best_angle_code = best_angle_code;
     f->best_num_lines = distance_range.num_lines;
     f->best_line = best_line;
@@ -743,6 +1750,68 @@ void findBestSubdivision(Fragment* f, Cache* cache, const CodecParams& cp) {
   }
 }
 
+/*
+ * Subdivision search for the fragment region. Cache should be prepared for
+ * the region; |plus| are the sums to the left of its rows ends.
+ */
+INLINE void searchPrepared(Fragment* f, Cache* cache, const CodecParams& cp,
+                           const Stats& plus) {
+  Vector<int32_t>& region = *f->region;
+  Stats stats;
+  uint32_t level = f->level;
+  // TODO(eustas): assert(level != CodecParams::kInvalid)
+  for (size_t i = 0; i < 4; ++i) stats.values[i] = f->stats[i];
+
+  // Find subdivision.
+  ExactSink best;
+  const uint32_t stride = cache->uber->approxRowStride;
+  if (cache->coarse_seeds) {
+    coarseToFineSubdivision(cache, &region, cp, level, stats, plus, &best);
+  } else if ((stride > 1) && (region.len >= stride * kMinApproxRows)) {
+    approxSubdivision(cache, &region, cp, level, stats, plus, &best);
+  } else {
+    evaluateCandidates(cache, region, region, cp, level, stats, plus, nullptr,
+                       &best);
+  }
+  applyBest(f, cache, cp, best);
+}
+
+void findBestSubdivision(Fragment* f, Cache* cache, const CodecParams& cp) {
+  Stats plus;
+  prepareCache(cache, f->region);
+  sumCache(cache, cache->x1->data(), &plus);
+  searchPrepared(f, cache, cp, plus);
+}
+
+bool searchAngleShare(const Fragment* f, Cache* cache, const CodecParams& cp,
+                      uint32_t first, uint32_t stride, SplitCandidate* best) {
+  Stats plus;
+  Stats stats;
+  for (size_t i = 0; i < 4; ++i) stats.values[i] = f->stats[i];
+  prepareCache(cache, f->region);
+  sumCache(cache, cache->x1->data(), &plus);
+  uint32_t angle_max = 1u << cp.angle_bits[f->level];
+  uint8_t angle_mask[SinCosT::kMaxAngle];
+  for (uint32_t angle_code = 0; angle_code < angle_max; ++angle_code) {
+    angle_mask[angle_code] = ((angle_code % stride) == first) ? 1 : 0;
+  }
+  ExactSink sink;
+  evaluateCandidates(cache, *f->region, *f->region, cp, f->level, stats, plus,
+                     angle_mask, &sink);
+  best->score = sink.score;
+  best->code = sink.code;
+  return sink.found;
+}
+
+void applySubdivision(Fragment* f, Cache* cache, const CodecParams& cp,
+                      bool found, const SplitCandidate& best) {
+  ExactSink sink;
+  sink.found = found;
+  sink.score = best.score;
+  sink.code = best.code;
+  applyBest(f, cache, cp, sink);
+}
+
 }  // namespace HWY_NAMESPACE
 }  // namespace twim
 HWY_AFTER_NAMESPACE();
@@ -768,13 +1837,17 @@ namespace twim {
 HWY_EXPORT(simulateEncode);
 HWY_EXPORT(chooseColor);
 HWY_EXPORT(findBestSubdivision);
-HWY_EXPORT(gatherPatches);
+HWY_EXPORT(searchAngleShare);
+HWY_EXPORT(applySubdivision);
+HWY_EXPORT(measureFragment);
+HWY_EXPORT(gatherChildren);
+HWY_EXPORT(selectPatches);
 HWY_EXPORT(buildPalette);
 #endif  // __wasm__
 
-float simulateEncode(float imageTax, const Partition& partition_holder,
-                     uint32_t target_size, const CodecParams& cp) {
-  return CALL(simulateEncode)(imageTax, partition_holder, target_size, cp);
+float simulateEncode(const Vector<float>* patches,
+                     const Vector<float>* palette, const CodecParams& cp) {
+  return CALL(simulateEncode)(patches, palette, cp);
 }
 
 uint32_t chooseColor(float r, float g, float b, const float* RESTRICT palette_r,
@@ -789,14 +1862,33 @@ void findBestSubdivision(Fragment* f, Cache* cache, const CodecParams& cp) {
   return CALL(findBestSubdivision)(f, cache, cp);
 }
 
-Vector<float>* gatherPatches(const Array<Fragment*>* partition,
-                             uint32_t num_non_leaf) {
-  return CALL(gatherPatches)(partition, num_non_leaf);
+bool searchAngleShare(const Fragment* f, Cache* cache, const CodecParams& cp,
+                      uint32_t first, uint32_t stride, SplitCandidate* best) {
+  return CALL(searchAngleShare)(f, cache, cp, first, stride, best);
+}
+
+void applySubdivision(Fragment* f, Cache* cache, const CodecParams& cp,
+                      bool found, const SplitCandidate& best) {
+  return CALL(applySubdivision)(f, cache, cp, found, best);
+}
+
+void measureFragment(Fragment* f, Cache* cache, const CodecParams& cp) {
+  return CALL(measureFragment)(f, cache, cp);
+}
+
+Vector<float>* gatherChildren(const Array<Fragment*>* partition,
+                              uint32_t max_non_leaf) {
+  return CALL(gatherChildren)(partition, max_non_leaf);
+}
+
+void selectPatches(const Vector<float>* children, uint32_t num_non_leaf,
+                   Vector<float>* patches) {
+  return CALL(selectPatches)(children, num_non_leaf, patches);
 }
 
 Vector<float>* buildPalette(const Vector<float>* patches,
-                            uint32_t palette_size) {
-  return CALL(buildPalette)(patches, palette_size);
+                            uint32_t palette_size, const Vector<float>* seed) {
+  return CALL(buildPalette)(patches, palette_size, seed);
 }
 
 }  // namespace twim
@@ -8,23 +8,63 @@ namespace twim {
 class Cache;
 class CodecParams;
 class Fragment;
-class Partition;
+struct SplitCandidate;
+struct SubdivisionResult;
 
-float simulateEncode(float imageTax, const Partition& partition_holder,
-                     uint32_t target_size, const CodecParams& cp);
+/*
+ * Returns the score (squared error minus a constant) of coloring |patches|
+ * with |palette| or (if palette is empty) with quantized colors.
+ */
+float simulateEncode(const Vector<float>* patches,
+                     const Vector<float>* palette, const CodecParams& cp);
 
 uint32_t chooseColor(float r, float g, float b, const float* RESTRICT palette_r,
                      const float* RESTRICT palette_g,
                      const float* RESTRICT palette_b, uint32_t palette_size,
                      float* RESTRICT distance2);
 
+/* Calculates fragment stats and bounds of subdivision score / cost. */
+void measureFragment(Fragment* f, Cache* cache, const CodecParams& cp);
+
+/* Fragment should be measured first. */
 void findBestSubdivision(Fragment* f, Cache* cache, const CodecParams& cp);
 
-Vector<float>* gatherPatches(
-    const Array<Fragment*>* partition, uint32_t num_non_leaf);
+/*
+ * Exact search over the share of angles: angle codes that are |first| modulo
+ * |stride|. Returns false if no candidate of the share splits the region;
+ * otherwise |best| is the first best candidate in evaluation order.
+ */
+bool searchAngleShare(const Fragment* f, Cache* cache, const CodecParams& cp,
+                      uint32_t first, uint32_t stride, SplitCandidate* best);
+
+/*
+ * Completes subdivision search with the best candidate of all shares; the
+ * result is the same as of findBestSubdivision with exact search.
+ */
+void applySubdivision(Fragment* f, Cache* cache, const CodecParams& cp,
+                      bool found, const SplitCandidate& best);
+
+/*
+ * Gathers stats of children of the first |max_non_leaf| nodes of partition,
+ * so that patches of any smaller subpartition are picked without touching
+ * the fragments.
+ */
+Vector<float>* gatherChildren(
+    const Array<Fragment*>* partition, uint32_t max_non_leaf);
+
+/*
+ * Fills |patches| with leaves of subpartition with |num_non_leaf| nodes;
+ * capacity should be enough for num_non_leaf + 1 patches.
+ */
+void selectPatches(const Vector<float>* children, uint32_t num_non_leaf,
+                   Vector<float>* patches);
 
-Vector<float>* buildPalette(
-    const Vector<float>* patches, uint32_t palette_size);
+/*
+ * k-means palette; if |seed| palette is given, its centers are used as the
+ * first centers, otherwise all the centers are chosen by k-means++.
+ */
+Vector<float>* buildPalette(const Vector<float>* patches,
+                            uint32_t palette_size, const Vector<float>* seed);
 
 }  // namespace twim
 
@@ -1,6 +1,15 @@
 #include "encoder.h"
 
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include "codec_params.h"
+#include "decoder.h"
+#include "encoder_simd.h"
 #include "gtest/gtest.h"
+#include "thread_pool.h"
 
 namespace twim {
 
@@ -17,6 +26,101 @@ Image makeCross() {
   }
   return Image::fromRgba(reinterpret_cast<uint8_t*>(tmp.data()), 20, 20);
 }
+/* Encoded data is the same byte by byte. */
+void expectSameStream(const Encoder::Result& expected,
+                      const Encoder::Result& actual) {
+  ASSERT_EQ(expected.data.size, actual.data.size);
+  for (size_t i = 0; i < expected.data.size; ++i) {
+    EXPECT_EQ(expected.data.data[i], actual.data.data[i]);
+  }
+}
+Image makeRings() {
+  std::vector<uint32_t> tmp(64 * 64);
+  for (size_t y = 0; y < 64; ++y) {
+    for (size_t x = 0; x < 64; ++x) {
+      size_t r2 = (x - 24) * (x - 24) + (y - 40) * (y - 40);
+      tmp[y * 64 + x] = ((r2 / 97) & 1) ? 0xFF30A0F0 : (0xFF000000 | 3 * x);
+    }
+  }
+  return Image::fromRgba(reinterpret_cast<uint8_t*>(tmp.data()), 64, 64);
+}
+
+/* Straightforward k-means++ / Lloyd palette; each patch is looked up with
+   chooseColor. */
+std::vector<float> referencePalette(const float* stats, uint32_t n,
+                                    uint32_t m) {
+  const uint32_t step = vecSize(n);
+  const float* r = stats;
+  const float* g = r + step;
+  const float* b = g + step;
+  const float* c = b + step;
+  const float* wr = c + step;
+  const float* wg = wr + step;
+  const float* wb = wg + step;
+  const uint32_t centers_step = vecSize(m);
+  Vector<float>* centers = allocVector<float>(3 * centers_step);
+  float* cr = centers->data();
+  float* cg = cr + centers_step;
+  float* cb = cg + centers_step;
+  std::vector<float> weights(n);
+  uint32_t random = 0x23DE605F;
+  for (uint32_t j = 0; j < m; ++j) {
+    float total = 0.0f;
+    for (uint32_t i = 0; i < n; ++i) {
+      float d2 = 1.0f;
+      if (j > 0) chooseColor(r[i], g[i], b[i], cr, cg, cb, j, &d2);
+      weights[i] = d2 * c[i];
+      total += weights[i];
+    }
+    if (j > 0) {
+      random ^= random << 13;
+      random ^= random >> 17;
+      random ^= random << 5;
+    }
+    float target = total * static_cast<float>((random >> 9) / 8388608.0);
+    float partial = 0.0f;
+    uint32_t i;
+    for (i = 0; i < n; ++i) {
+      partial += weights[i];
+      if (partial >= target) break;
+    }
+    i = std::min(i, n - 1);
+    cr[j] = r[i];
+    cg[j] = g[i];
+    cb[j] = b[i];
+  }
+  float last_score = 1e35f;
+  while (true) {
+    std::vector<float> acc(4 * m, 0.0f);
+    float score = 0.0f;
+    for (uint32_t i = 0; i < n; ++i) {
+      float d2;
+      uint32_t k = chooseColor(r[i], g[i], b[i], cr, cg, cb, m, &d2);
+      score += d2 * c[i];
+      acc[4 * k + 0] += wr[i];
+      acc[4 * k + 1] += wg[i];
+      acc[4 * k + 2] += wb[i];
+      acc[4 * k + 3] += c[i];
+    }
+    for (uint32_t k = 0; k < m; ++k) {
+      float inv_c = 1.0f / std::max(acc[4 * k + 3], 1.0f);
+      cr[k] = acc[4 * k + 0] * inv_c;
+      cg[k] = acc[4 * k + 1] * inv_c;
+      cb[k] = acc[4 * k + 2] * inv_c;
+    }
+    if (last_score - score < 1.0f) break;
+    last_score = score;
+  }
+  std::vector<float> result;
+  for (const float* row : {cr, cg, cb}) {
+    for (uint32_t k = 0; k < m; ++k) {
+      int32_t rounded = static_cast<int32_t>(row[k] + 0.5f);
+      result.push_back(static_cast<float>(rounded));
+    }
+  }
+  delete centers;
+  return result;
+}
 }  // namespace
 
 TEST(EncoderTest, EncodeCross) {
@@ -39,4 +143,512 @@ TEST(EncoderTest, EncodeCross) {
   ASSERT_TRUE(false);*/
 }
 
+TEST(EncoderTest, VerticalShearTableIsExact) {
+  Encoder::Params params = {};
+  params.targetSize = 40;
+  Encoder::Variant variant;
+  variant.partitionCode = 0xD7;
+  variant.lineLimit = 62;
+  variant.colorOptions = 1 << 18;
+  params.variants = &variant;
+  params.numVariants = 1;
+  auto expected = Encoder::encode(makeCross(), params);
+  // Only table for vertical lines; its rasterization is the same.
+  params.shearTableBits = 1;
+  auto actual = Encoder::encode(makeCross(), params);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, ApproxSearchWithAllCandidatesIsExact) {
+  Encoder::Params params = {};
+  params.targetSize = 100;
+  Encoder::Variant variant;
+  variant.partitionCode = 0xD7;
+  variant.lineLimit = 62;
+  variant.colorOptions = 1 << 18;
+  params.variants = &variant;
+  params.numVariants = 1;
+  auto expected = Encoder::encode(makeRings(), params);
+  ASSERT_EQ(0u, expected.approxSearches);
+  // All the candidates are re-evaluated.
+  params.approxRowStride = 2;
+  params.approxTopK = 1u << 16;
+  auto actual = Encoder::encode(makeRings(), params);
+  ASSERT_LT(0u, actual.approxSearches);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, CoarseSearchWithAllSeedsIsExact) {
+  Encoder::Params params = {};
+  params.targetSize = 100;
+  Encoder::Variant variant;
+  variant.partitionCode = 0xD7;
+  variant.lineLimit = 62;
+  variant.colorOptions = 1 << 18;
+  params.variants = &variant;
+  params.numVariants = 1;
+  auto expected = Encoder::encode(makeRings(), params);
+  // Every coarse angle is a seed, i.e. all the angles are evaluated.
+  params.coarseAngleStep = 4;
+  params.coarseSeeds = SinCos.kMaxAngle / 4;
+  auto actual = Encoder::encode(makeRings(), params);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, SharedSearchIsExact) {
+  Encoder::Params params = {};
+  params.targetSize = 100;
+  std::vector<Encoder::Variant> variants;
+  for (uint32_t code = 0x03; code < 500; code += 40) {
+    for (uint32_t lineLimit = 2; lineLimit < 63; lineLimit += 12) {
+      Encoder::Variant variant;
+      variant.partitionCode = code;
+      variant.lineLimit = lineLimit;
+      variant.colorOptions = 1 << 18;
+      variants.push_back(variant);
+    }
+  }
+  params.variants = variants.data();
+  params.numVariants = variants.size();
+  params.sharedSearchDepth = 0;
+  auto expected = Encoder::encode(makeRings(), params);
+  params.sharedSearchDepth = 64;
+  auto actual = Encoder::encode(makeRings(), params);
+  EXPECT_EQ(expected.variant.partitionCode, actual.variant.partitionCode);
+  EXPECT_EQ(expected.variant.lineLimit, actual.variant.lineLimit);
+  EXPECT_EQ(expected.mse, actual.mse);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, EquivalentVariantsAreReportedExactly) {
+  Encoder::Params params = {};
+  params.targetSize = 24;
+  // Line limit does not matter for 20x20 image once it is above 30.
+  Encoder::Variant variants[2];
+  variants[0].partitionCode = 0xD7;
+  variants[0].lineLimit = 40;
+  variants[0].colorOptions = 1 << 18;
+  variants[1] = variants[0];
+  variants[1].lineLimit = 50;
+  params.numVariants = 1;
+  params.variants = variants + 1;
+  auto expected = Encoder::encode(makeCross(), params);
+  // Only the first variant is simulated; result is the same.
+  params.numVariants = 2;
+  params.variants = variants;
+  std::swap(variants[0], variants[1]);
+  auto actual = Encoder::encode(makeCross(), params);
+  EXPECT_EQ(50u, actual.variant.lineLimit);
+  EXPECT_EQ(expected.mse, actual.mse);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, LineLimitBatchIsExact) {
+  Encoder::Params params = {};
+  params.targetSize = 100;
+  params.sharedSearchDepth = 0;
+  std::vector<Encoder::Variant> variants;
+  for (uint32_t lineLimit = 1; lineLimit < 63; lineLimit += 5) {
+    Encoder::Variant variant;
+    variant.partitionCode = 0x1C3;
+    variant.lineLimit = lineLimit;
+    variant.colorOptions = 1 << 18;
+    variants.push_back(variant);
+  }
+  // Each variant alone is simulated without the shared root search.
+  params.numVariants = 1;
+  size_t best = 0;
+  float bestMse = 1e35f;
+  for (size_t i = 0; i < variants.size(); ++i) {
+    params.variants = variants.data() + i;
+    float mse = Encoder::encode(makeRings(), params).mse;
+    if (mse < bestMse) {
+      best = i;
+      bestMse = mse;
+    }
+  }
+  params.variants = variants.data() + best;
+  auto expected = Encoder::encode(makeRings(), params);
+  params.numVariants = variants.size();
+  params.variants = variants.data();
+  auto actual = Encoder::encode(makeRings(), params);
+  EXPECT_EQ(expected.variant.lineLimit, actual.variant.lineLimit);
+  EXPECT_EQ(expected.mse, actual.mse);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, ProxySearchEncodesAtFullResolution) {
+  Encoder::Params params = {};
+  params.targetSize = 100;
+  std::vector<Encoder::Variant> variants;
+  for (uint32_t code = 0x03; code < 500; code += 40) {
+    for (uint32_t lineLimit = 2; lineLimit < 63; lineLimit += 12) {
+      Encoder::Variant variant;
+      variant.partitionCode = code;
+      variant.lineLimit = lineLimit;
+      variant.colorOptions = 1 << 18;
+      variants.push_back(variant);
+    }
+  }
+  params.variants = variants.data();
+  params.numVariants = variants.size();
+  params.proxySize = 32;
+  params.proxyVariants = 4;
+  auto actual = Encoder::encode(makeRings(), params);
+  // Shortlist is the best of the variants simulated on the proxy alone.
+  Image proxy = Image::downscale(makeRings(), 2);
+  std::vector<float> mse(variants.size());
+  std::vector<size_t> order(variants.size());
+  Encoder::Params single = {};
+  single.targetSize = params.targetSize;
+  single.numVariants = 1;
+  for (size_t i = 0; i < variants.size(); ++i) {
+    single.variants = &variants[i];
+    mse[i] = Encoder::encode(proxy, single).mse;
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&](size_t l, size_t r) { return mse[l] < mse[r]; });
+  order.resize(params.proxyVariants);
+  std::sort(order.begin(), order.end());
+  EXPECT_EQ(order, actual.shortlist);
+  // Workers recycle partitions of the variants that lose to others.
+  params.numThreads = 3;
+  auto parallel = Encoder::encode(makeRings(), params);
+  EXPECT_EQ(actual.shortlist, parallel.shortlist);
+  EXPECT_EQ(actual.mse, parallel.mse);
+  expectSameStream(actual, parallel);
+  // Chosen variant alone gives the same stream.
+  params.numThreads = 1;
+  params.proxySize = 0;
+  params.variants = &actual.variant;
+  params.numVariants = 1;
+  auto expected = Encoder::encode(makeRings(), params);
+  EXPECT_EQ(expected.mse, actual.mse);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, LocalSearchWithAllSeedsIsExhaustive) {
+  Encoder::Params params = {};
+  params.targetSize = 100;
+  std::vector<Encoder::Variant> variants;
+  for (uint32_t code = 0x07; code < 500; code += 70) {
+    for (uint32_t lineLimit = 3; lineLimit < 63; lineLimit += 20) {
+      Encoder::Variant variant;
+      variant.partitionCode = code;
+      variant.lineLimit = lineLimit;
+      variant.colorOptions = 1 << 18;
+      variants.push_back(variant);
+    }
+  }
+  params.variants = variants.data();
+  params.numVariants = variants.size();
+  auto expected = Encoder::encode(makeRings(), params);
+  params.localSearchSeeds = variants.size();
+  auto actual = Encoder::encode(makeRings(), params);
+  EXPECT_EQ(expected.variant.partitionCode, actual.variant.partitionCode);
+  EXPECT_EQ(expected.variant.lineLimit, actual.variant.lineLimit);
+  EXPECT_EQ(expected.mse, actual.mse);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, SweepWithFullPatienceIsExhaustive) {
+  Encoder::Params params = {};
+  params.targetSize = 100;
+  std::vector<Encoder::Variant> variants;
+  for (uint32_t code = 0x07; code < 500; code += 70) {
+    for (uint32_t lineLimit = 3; lineLimit < 63; lineLimit += 20) {
+      Encoder::Variant variant;
+      variant.partitionCode = code;
+      variant.lineLimit = lineLimit;
+      variant.colorOptions = 1 << 18;
+      variants.push_back(variant);
+    }
+  }
+  params.variants = variants.data();
+  params.numVariants = variants.size();
+  auto expected = Encoder::encode(makeRings(), params);
+  params.patience = variants.size();
+  auto actual = Encoder::encode(makeRings(), params);
+  EXPECT_EQ(expected.variant.partitionCode, actual.variant.partitionCode);
+  EXPECT_EQ(expected.variant.lineLimit, actual.variant.lineLimit);
+  EXPECT_EQ(expected.mse, actual.mse);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, ParallelWorkersAreExact) {
+  Encoder::Params params = {};
+  params.targetSize = 100;
+  std::vector<Encoder::Variant> variants;
+  for (uint32_t code = 0x03; code < 500; code += 40) {
+    for (uint32_t lineLimit = 2; lineLimit < 63; lineLimit += 12) {
+      Encoder::Variant variant;
+      variant.partitionCode = code;
+      variant.lineLimit = lineLimit;
+      variant.colorOptions = 1 << 18;
+      variants.push_back(variant);
+    }
+  }
+  params.variants = variants.data();
+  params.numVariants = variants.size();
+  auto expected = Encoder::encode(makeRings(), params);
+  EXPECT_EQ(1u, expected.workerUtilization.size());
+  params.numThreads = 3;
+  auto actual = Encoder::encode(makeRings(), params);
+  EXPECT_EQ(3u, actual.workerUtilization.size());
+  EXPECT_EQ(expected.variant.partitionCode, actual.variant.partitionCode);
+  EXPECT_EQ(expected.variant.lineLimit, actual.variant.lineLimit);
+  EXPECT_EQ(expected.mse, actual.mse);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, ParallelWorkersKeepTheFirstOfEqualVariants) {
+  std::vector<uint32_t> tmp(16 * 16);
+  for (size_t y = 0; y < 16; ++y) {
+    for (size_t x = 0; x < 16; ++x) {
+      size_t r2 = (x - 6) * (x - 6) + (y - 10) * (y - 10);
+      tmp[y * 16 + x] = ((r2 / 11) & 1) ? 0xFF30A0F0 : (0xFF000000 | 13 * x);
+    }
+  }
+  Image src = Image::fromRgba(reinterpret_cast<uint8_t*>(tmp.data()), 16, 16);
+  // 0xC8 and 0x12C give the same partition of 16x16 image. Color code 18
+  // is the best one, 17 is the worst.
+  CodecParams a(16, 16);
+  CodecParams b(16, 16);
+  a.setPartitionCode(0xC8);
+  b.setPartitionCode(0x12C);
+  ASSERT_TRUE(a.getPartitionSignature() == b.getPartitionSignature());
+  auto make = [](uint32_t code, uint64_t colorOptions) {
+    Encoder::Variant variant;
+    variant.partitionCode = code;
+    variant.lineLimit = 62;
+    variant.colorOptions = colorOptions;
+    return variant;
+  };
+  const uint64_t bad = (uint64_t)1 << 17;
+  const uint64_t good = (uint64_t)1 << 18;
+  const uint64_t worse = ((uint64_t)1 << 29) | ((uint64_t)1 << 30);
+  // Both 0xC8 and 0x12C variants are the best.
+  std::vector<Encoder::Variant> variants = {
+      make(0x10, bad | worse), make(0x20, bad | worse), make(0x30, bad | worse),
+      make(0xC8, good), make(0x12C, good | bad)};
+  Encoder::Params params = {};
+  params.targetSize = 60;
+  params.variants = variants.data();
+  params.numVariants = variants.size();
+  auto expected = Encoder::encode(src, params);
+  EXPECT_EQ(0xC8u, expected.variant.partitionCode);
+  // The first worker gets the first 4 variants, the second one gets 0x12C.
+  // Pool without threads runs the workers in turns: the second one runs
+  // 0x12C, then steals 0xC8 while the first one has 2 variants left.
+  ThreadPool serial(0);
+  params.pool = &serial;
+  params.firstWorkerTasks = 4;
+  params.numThreads = 2;
+  auto actual = Encoder::encode(src, params);
+  EXPECT_EQ(1u, actual.stolenBatches);
+  EXPECT_EQ(expected.variant.partitionCode, actual.variant.partitionCode);
+  EXPECT_EQ(expected.mse, actual.mse);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, ParallelColorCodesAreExact) {
+  Encoder::Params params = {};
+  params.targetSize = 100;
+  Encoder::Variant variant;
+  variant.partitionCode = 0xD7;
+  variant.lineLimit = 62;
+  variant.colorOptions = ((uint64_t)1 << CodecParams::kMaxColorCode) - 1;
+  params.variants = &variant;
+  params.numVariants = 1;
+  auto expected = Encoder::encode(makeRings(), params);
+  // Spare threads evaluate color codes of the only variant.
+  params.numThreads = 5;
+  auto actual = Encoder::encode(makeRings(), params);
+  EXPECT_EQ(expected.variant.colorOptions, actual.variant.colorOptions);
+  EXPECT_EQ(expected.mse, actual.mse);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, ParallelPartitionSearchIsExact) {
+  Encoder::Params params = {};
+  params.targetSize = 400;
+  params.approxRowStride = 4;
+  Encoder::Variant variant;
+  variant.partitionCode = 0x1F3;
+  variant.lineLimit = 62;
+  variant.colorOptions = 1;
+  params.variants = &variant;
+  params.numVariants = 1;
+  auto expected = Encoder::encode(makeRings(), params);
+  // Spare threads search subdivisions of queued fragments.
+  params.numThreads = 4;
+  auto actual = Encoder::encode(makeRings(), params);
+  EXPECT_EQ(expected.mse, actual.mse);
+  EXPECT_EQ(expected.approxSearches, actual.approxSearches);
+  EXPECT_EQ(expected.approxMismatches, actual.approxMismatches);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, ParallelAngleSweepIsExact) {
+  Encoder::Params params = {};
+  params.targetSize = 400;
+  Encoder::Variant variant;
+  variant.partitionCode = 0x1F3;
+  variant.lineLimit = 62;
+  variant.colorOptions = 1;
+  params.variants = &variant;
+  params.numVariants = 1;
+  auto expected = Encoder::encode(makeRings(), params);
+  // Angles of all the fragments are split between threads.
+  params.numThreads = 3;
+  params.parallelSearchRows = 1;
+  auto actual = Encoder::encode(makeRings(), params);
+  EXPECT_EQ(expected.mse, actual.mse);
+  expectSameStream(expected, actual);
+}
+
+TEST(EncoderTest, TiledPartitionIsDecodable) {
+  Encoder::Params params = {};
+  params.targetSize = 400;
+  Encoder::Variant variant;
+  variant.partitionCode = 0x1F3;
+  variant.lineLimit = 62;
+  variant.colorOptions = 1 << 18;
+  params.variants = &variant;
+  params.numVariants = 1;
+  params.tilingLevels = 2;
+  auto expected = Encoder::encode(makeRings(), params);
+  // Tiles are built by different threads; result is the same.
+  params.numThreads = 3;
+  auto actual = Encoder::encode(makeRings(), params);
+  expectSameStream(expected, actual);
+
+  // Stream is a regular one.
+  Image decoded = Decoder::decode(std::vector<uint8_t>(
+      actual.data.data, actual.data.data + actual.data.size));
+  ASSERT_TRUE(decoded.ok);
+  EXPECT_EQ(64u, decoded.width);
+  EXPECT_EQ(64u, decoded.height);
+}
+
+TEST(EncoderTest, ConcurrentAsyncEncodingsAreExact) {
+  Encoder::Params params = {};
+  params.targetSize = 200;
+  params.numThreads = 3;
+  std::vector<Encoder::Variant> variants(6);
+  for (size_t i = 0; i < variants.size(); ++i) {
+    variants[i].partitionCode = 0xD7 + 3 * i;
+    variants[i].lineLimit = 62;
+    variants[i].colorOptions = 3;
+  }
+  params.variants = variants.data();
+  params.numVariants = variants.size();
+  Image src = makeRings();
+  auto expected = Encoder::encode(src, params);
+  // Both requests share the pool threads.
+  auto first = Encoder::encodeAsync(src, params);
+  auto second = Encoder::encodeAsync(src, params);
+  // Encoding could be waited for by several threads.
+  std::thread other([&first] { first->wait(); });
+  const Encoder::Result* actual[] = {&first->wait(), &second->wait()};
+  other.join();
+  EXPECT_TRUE(first->done());
+  for (const Encoder::Result* result : actual) {
+    EXPECT_FALSE(result->cancelled);
+    EXPECT_EQ(expected.mse, result->mse);
+    expectSameStream(expected, *result);
+  }
+}
+
+TEST(EncoderTest, CancelledEncodingIsEmpty) {
+  Encoder::Params params = {};
+  params.targetSize = 200;
+  params.numThreads = 2;
+  std::vector<Encoder::Variant> variants(64);
+  for (size_t i = 0; i < variants.size(); ++i) {
+    variants[i].partitionCode = 0xD7 + i;
+    variants[i].lineLimit = 62;
+    variants[i].colorOptions = 1;
+  }
+  params.variants = variants.data();
+  params.numVariants = variants.size();
+  // Patience sweep checks for cancellation between the chunks.
+  params.patience = 1000;
+  Image src = makeRings();
+  auto encoding = Encoder::encodeAsync(src, params);
+  encoding->cancel();
+  const Encoder::Result& result = encoding->wait();
+  EXPECT_TRUE(encoding->done());
+  EXPECT_TRUE(result.cancelled);
+  EXPECT_EQ(0u, result.data.size);
+}
+
+TEST(EncoderTest, BuildPaletteMatchesReference) {
+  constexpr uint32_t n = 157;
+  const uint32_t step = vecSize(n);
+  Vector<float>* patches = allocVector<float>(7 * step);
+  float* stats = patches->data();
+  uint32_t random = 0x5EED;
+  for (uint32_t i = 0; i < n; ++i) {
+    random = random * 1103515245u + 12345u;
+    float area = static_cast<float>(1 + ((random >> 16) & 63));
+    for (uint32_t j = 0; j < 3; ++j) {
+      random = random * 1103515245u + 12345u;
+      // Coarse values -> lots of ties.
+      float v = static_cast<float>(((random >> 16) & 7) * 32);
+      stats[j * step + i] = v;
+      stats[(4 + j) * step + i] = v * area;
+    }
+    stats[3 * step + i] = area;
+  }
+  patches->len = n;
+  for (uint32_t m = 1; m <= 32; ++m) {
+    std::vector<float> expected = referencePalette(stats, n, m);
+    Vector<float>* palette = buildPalette(patches, m, nullptr);
+    const uint32_t centers_step = vecSize(m);
+    for (uint32_t j = 0; j < 3; ++j) {
+      for (uint32_t k = 0; k < m; ++k) {
+        ASSERT_EQ(expected[j * m + k], palette->data()[j * centers_step + k]);
+      }
+    }
+    delete palette;
+  }
+  delete patches;
+}
+
+TEST(EncoderTest, ChooseColorPicksFirstNearest) {
+  constexpr uint32_t kMaxPaletteSize = 32;
+  const uint32_t step = vecSize(kMaxPaletteSize);
+  Vector<float>* palette = allocVector<float>(3 * step);
+  float* r = palette->data();
+  float* g = r + step;
+  float* b = g + step;
+  for (uint32_t m = 1; m <= kMaxPaletteSize; ++m) {
+    for (uint32_t i = 0; i < step; ++i) {
+      // Few distinct colors -> lots of ties.
+      float v = (i < m) ? static_cast<float>((i * 7) % 5) : NAN;
+      r[i] = v;
+      g[i] = v;
+      b[i] = (i < m) ? 0.0f : -1.0f;
+    }
+    for (float c = -1.0f; c < 6.0f; c += 0.5f) {
+      uint32_t expected = 0;
+      float expected_d2 = 1e35f;
+      for (uint32_t i = 0; i < m; ++i) {
+        float d2 = 2.0f * (c - r[i]) * (c - r[i]);
+        if (d2 < expected_d2) {
+          expected = i;
+          expected_d2 = d2;
+        }
+      }
+      float d2;
+      uint32_t index = chooseColor(c, c, 0.0f, r, g, b, m, &d2);
+      ASSERT_EQ(expected, index);
+      ASSERT_EQ(expected_d2, d2);
+    }
+  }
+  delete palette;
+}
+
 }  // namespace twim
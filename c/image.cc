@@ -1,4 +1,7 @@
 #include "image.h"
+
+#include <algorithm>
+
 #include "platform.h"
 
 namespace twim {
@@ -42,4 +45,38 @@ Image Image::fromRgba(const uint8_t* src, uint32_t width, uint32_t height) {
   return result;
 }
 
+Image Image::downscale(const Image& src, uint32_t factor) {
+  Image result;
+  result.init((src.width + factor - 1) / factor,
+              (src.height + factor - 1) / factor);
+  if (result.ok) {
+    for (uint32_t y = 0; y < result.height; ++y) {
+      uint32_t y0 = y * factor;
+      uint32_t y1 = std::min(y0 + factor, src.height);
+      for (uint32_t x = 0; x < result.width; ++x) {
+        uint32_t x0 = x * factor;
+        uint32_t x1 = std::min(x0 + factor, src.width);
+        uint32_t sum_r = 0;
+        uint32_t sum_g = 0;
+        uint32_t sum_b = 0;
+        for (uint32_t yy = y0; yy < y1; ++yy) {
+          size_t offset = yy * src.width;
+          for (uint32_t xx = x0; xx < x1; ++xx) {
+            sum_r += src.r[offset + xx];
+            sum_g += src.g[offset + xx];
+            sum_b += src.b[offset + xx];
+          }
+        }
+        uint32_t count = (y1 - y0) * (x1 - x0);
+        size_t offset = y * result.width + x;
+        result.r[offset] = (sum_r + count / 2) / count;
+        result.g[offset] = (sum_g + count / 2) / count;
+        result.b[offset] = (sum_b + count / 2) / count;
+      }
+    }
+  }
+
+  return result;
+}
+
 }  // namespace twim
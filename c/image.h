@@ -18,6 +18,9 @@ struct Image {
   void init(uint32_t width, uint32_t height);
 
   static Image fromRgba(const uint8_t* src, uint32_t width, uint32_t height);
+
+  /* Area-averaged downscale; last row / column of blocks might be partial. */
+  static Image downscale(const Image& src, uint32_t factor);
 };
 
 }  // namespace twim
@@ -1,5 +1,8 @@
 #include "io.h"
 
+#include <dirent.h>
+
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <memory>
@@ -43,6 +46,19 @@ bool Io::writeFile(const std::string& path, const uint8_t* data, size_t size) {
   return written == size;
 }
 
+std::vector<std::string> Io::listDirectory(const std::string& path) {
+  std::vector<std::string> result;
+  std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir(path.c_str()), closedir);
+  if (!dir) return result;
+  while (const dirent* entry = readdir(dir.get())) {
+    std::string name(entry->d_name);
+    if (name == "." || name == "..") continue;
+    result.push_back(path + "/" + name);
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
 struct Png {
   png_structp png_ptr = nullptr;
   png_infop info_ptr = nullptr;
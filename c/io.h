@@ -14,6 +14,8 @@ class Io {
   static std::vector<uint8_t> readFile(const std::string& path);
   static bool writeFile(const std::string& path,
                         const uint8_t* data, size_t size);
+  /* Returns sorted paths of the directory entries, except "." and "..". */
+  static std::vector<std::string> listDirectory(const std::string& path);
 
   static Image readPng(const std::string& path);
   static bool writePng(const std::string& path, const Image& img);
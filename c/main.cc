@@ -9,6 +9,7 @@
 #include "encoder.h"
 #include "io.h"
 #include "platform.h"
+#include "variant_prior.h"
 #include "xrange_decoder.h"
 #include "xrange_encoder.h"
 
@@ -77,20 +78,47 @@ const uint32_t kMaxTargetSize = 1024 * 1024;
 void printHelp(const char* name, bool error) {
   FILE* media = error ? stderr : stdout;
   fprintf(media,
-"Usage: %s [OPTION]... [FILE]...\n",
-          name);
+"Usage: %s [OPTION]... [FILE]...\n"
+"  or:  %s prior [OPTION]... PRIOR_FILE [DIR]...\n",
+          name, name);
   fprintf(media,
 "Options:\n"
+"  -a###  approximate subdivision search: use every ###-th row (1..64);\n"
+"         default: 1 (exact search)\n"
+"  -b###  tiling: split top ### tree levels in halves and build subtrees of\n"
+"         the tiles independently (0..8); default: 0 (no tiling)\n"
+"  -c###  coarse-to-fine subdivision search: angle step (1..64); default: 1\n"
+"         (exhaustive search)\n"
 "  -d     decode\n"
 "  -e     encode\n"
+"  -f###  stop simulating variants once those cover ###%% of prior wins\n"
+"         (0..100); default: 0 (no limit)\n"
+"  -g###  split angles of subdivision search of fragments with at least ###\n"
+"         rows between spare threads (0..65536); default: 512 (0: never)\n"
 "  -j###  set number of threads (1..256); default: 1\n"
 "  -h     display this help and exit\n"
+"  -iFILE simulate variants in order of the prior from FILE; see below\n"
+"  -k###  stop simulating variants once ### of them in a row do not improve\n"
+"         the result; default: 0 (no limit)\n"
+"  -l###  local variant search: number of hill climbers (0..256); default: 0\n"
+"         (simulate all variants)\n"
+"  -n###  proxy variant search: number of variants simulated at full\n"
+"         resolution (1..65536); default: 16\n"
 "  -p###  encoding parameters (see below); default: all possible combinations\n"
-"  -r     decode after encoding\n");
+"  -r     decode after encoding\n"
+"  -s###  share subdivision search results of top ### tree levels between\n"
+"         variants (0..64); default: 16\n");
   fprintf(media,
 "  -t###  set target encoded size in bytes (%d..%d); default: %d\n",
           kMinTargetSize, kMaxTargetSize, kDefaultTargetSize);
   fprintf(media,
+"  -v###  precompute sheared sums for every (512 >> ###)-th near-vertical\n"
+"         angle (0..9); faster search of those lines, slightly different\n"
+"         rasterization; default: 0 (no tables)\n"
+"  -w     seed palette of each size with the previous one (faster, but\n"
+"         slightly different palettes)\n"
+"  -x###  proxy variant search: simulate all variants on the image\n"
+"         downscaled to ### pixels (0..2048); default: 0 (no proxy)\n"
 "\n"
 "Encoding parameters (-p option) should match the following pattern:\n"
 "  (PARTITION_CODE:LINE_LIMIT:COLOR_SCHEMES,)+\n"
@@ -99,7 +127,11 @@ void printHelp(const char* name, bool error) {
 "combined via bitwise \"or\"; trailing comma could be omitted.\n"
 "\n"
 "Options and files could be mixed, e.g '-d a.2im -e b.png -t42 c.png' will\n"
-"decode a.2im, endode b.png, set target size to 42 and encode c.png\n");
+"decode a.2im, endode b.png, set target size to 42 and encode c.png\n"
+"\n"
+"'prior' command encodes PNG images in each DIR and adds the chosen variants\n"
+"to PRIOR_FILE (it is created, if necessary); wins are counted separately\n"
+"for groups of similar images.\n");
 }
 
 void fillAllVariants(std::vector<Variant>* variants) {
@@ -176,13 +208,29 @@ int main(int argc, char* argv[]) {
   std::vector<Variant> variants;
   fillAllVariants(&variants);
   params.variants = variants.data();
+  // Variants ranked by prior and their weights.
+  bool usePrior = false;
+  VariantPrior prior;
+  std::vector<Variant> ranked;
+  std::vector<float> weights;
+  uint32_t confidence = 0;
+  // "prior" command: file to update.
+  bool buildPrior = false;
+  std::string priorPath;
+  VariantPrior newPrior;
 
   if (argc < 2) {
     printHelp(fileName(argv[0]), false);
     exit(EXIT_FAILURE);
   }
 
-  for (int i = 1; i < argc; ++i) {
+  int firstArg = 1;
+  if (strcmp(argv[1], "prior") == 0) {
+    buildPrior = true;
+    firstArg = 2;
+  }
+
+  for (int i = firstArg; i < argc; ++i) {
     if (argv[i] == nullptr) {
       continue;
     }
@@ -211,19 +259,107 @@ int main(int argc, char* argv[]) {
       } else if (cmd == 'j') {
         bool ok = parseInt(val, 1, 256, &params.numThreads);
         if (ok) continue;
+      } else if (cmd == 'a') {
+        bool ok = parseInt(val, 1, 64, &params.approxRowStride);
+        if (ok) continue;
+      } else if (cmd == 'b') {
+        bool ok = parseInt(val, 0, 8, &params.tilingLevels);
+        if (ok) continue;
+      } else if (cmd == 'c') {
+        bool ok = parseInt(val, 1, 64, &params.coarseAngleStep);
+        if (ok) continue;
+      } else if (cmd == 'g') {
+        bool ok = parseInt(val, 0, 65536, &params.parallelSearchRows);
+        if (ok) continue;
+      } else if (cmd == 's') {
+        bool ok = parseInt(val, 0, 64, &params.sharedSearchDepth);
+        if (ok) continue;
+      } else if (cmd == 'l') {
+        bool ok = parseInt(val, 0, 256, &params.localSearchSeeds);
+        if (ok) continue;
+      } else if (cmd == 'n') {
+        bool ok = parseInt(val, 1, 65536, &params.proxyVariants);
+        if (ok) continue;
+      } else if (cmd == 'v') {
+        bool ok = parseInt(val, 0, 9, &params.shearTableBits);
+        if (ok) continue;
+      } else if (cmd == 'w') {
+        params.warmPalettes = true;
+        continue;
+      } else if (cmd == 'x') {
+        bool ok = parseInt(val, 0, 2048, &params.proxySize);
+        if (ok) continue;
+      } else if (cmd == 'i') {
+        auto data = Io::readFile(val);
+        std::string text(data.begin(), data.end());
+        bool ok = !data.empty() && prior.parse(text);
+        if (ok) {
+          usePrior = true;
+          continue;
+        }
+      } else if (cmd == 'k') {
+        bool ok = parseInt(val, 0, 1u << 20, &params.patience);
+        if (ok) continue;
+      } else if (cmd == 'f') {
+        bool ok = parseInt(val, 0, 100, &confidence);
+        if (ok) {
+          params.confidence = confidence / 100.0f;
+          continue;
+        }
       }
       fprintf(stderr, "Unknown / invalid option: %s\n", argv[i]);
       printHelp(fileName(argv[0]), false);
       exit(EXIT_FAILURE);
     }
     std::string path(argv[i]);
-    if (encode) {
+    if (buildPrior) {
+      if (priorPath.empty()) {
+        priorPath = path;
+        auto data = Io::readFile(path);
+        std::string text(data.begin(), data.end());
+        if (!newPrior.parse(text)) {
+          fprintf(stderr, "Corrupted prior [%s].\n", path.c_str());
+          exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      params.variants = variants.data();
       params.numVariants = variants.size();
+      params.variantWeights = nullptr;
+      for (const std::string& file : Io::listDirectory(path)) {
+        if (file.size() < 4 || file.substr(file.size() - 4) != ".png") {
+          continue;
+        }
+        const Image src = Io::readPng(file);
+        if (!src.ok) {
+          fprintf(stderr, "Failed to read PNG image [%s].\n", file.c_str());
+          continue;
+        }
+        Result result = Encoder::encode(src, params);
+        if (result.data.size == 0) continue;
+        std::string group = VariantPrior::classify(src);
+        newPrior.addWin(group, result.variant);
+        fprintf(stderr, "%s: %s %X:%X\n", file.c_str(), group.c_str(),
+                static_cast<uint32_t>(result.variant.partitionCode),
+                static_cast<uint32_t>(result.variant.lineLimit));
+      }
+      continue;
+    }
+    if (encode) {
       const Image src = Io::readPng(path);
       if (!src.ok) {
         fprintf(stderr, "Failed to read PNG image [%s].\n", path.c_str());
         continue;
       }
+      params.variants = variants.data();
+      params.numVariants = variants.size();
+      params.variantWeights = nullptr;
+      if (usePrior) {
+        ranked = variants;
+        prior.rank(VariantPrior::classify(src), &ranked, &weights);
+        params.variants = ranked.data();
+        params.variantWeights = weights.data();
+      }
       Result result = Encoder::encode(src, params);
       Variant variant = result.variant;
       uint32_t partitionCode = variant.partitionCode;
@@ -238,6 +374,19 @@ int main(int argc, char* argv[]) {
       out << "size=" << result.data.size << ", PSNR=" << psnr << std::uppercase
           << std::hex << ", variant=" << partitionCode << ":"
           << ((uint64_t)1 << lineLimit) << ":" << colorCode;
+      if (result.approxSearches > 0) {
+        out << std::dec << ", approx_mismatches=" << result.approxMismatches
+            << "/" << result.approxSearches;
+      }
+      if (result.workerUtilization.size() > 1) {
+        out << std::dec << ", utilization=";
+        for (size_t w = 0; w < result.workerUtilization.size(); ++w) {
+          if (w > 0) out << "/";
+          out << static_cast<int>(100.0f * result.workerUtilization[w] + 0.5f)
+              << "%";
+        }
+        out << ", stolen=" << result.stolenBatches;
+      }
       fprintf(stderr, "%s\n", out.str().c_str());
       path += ".2im";
       Io::writeFile(path, result.data.data, result.data.size);
@@ -261,6 +410,19 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  if (buildPrior) {
+    if (priorPath.empty()) {
+      printHelp(fileName(argv[0]), false);
+      exit(EXIT_FAILURE);
+    }
+    std::string text = newPrior.serialize();
+    if (!Io::writeFile(priorPath, reinterpret_cast<const uint8_t*>(text.data()),
+                       text.size())) {
+      fprintf(stderr, "Failed to write [%s].\n", priorPath.c_str());
+      exit(EXIT_FAILURE);
+    }
+  }
+
   return 0;
 }
 
@@ -1,5 +1,6 @@
 #include "platform.h"
 
+#include <algorithm>
 #include <cstring>
 
 namespace twim {
@@ -21,4 +22,47 @@ uint32_t vecSize(uint32_t capacity) {
   return static_cast<uint32_t>((capacity + N - 1) & ~(N - 1));
 }
 
+Arena::~Arena() {
+  Chunk* chunk = first;
+  while (chunk) {
+    Chunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+}
+
+void* Arena::alloc(size_t size) {
+  size = (size + kDefaultAlign - 1) & ~(kDefaultAlign - 1);
+  while (!current || used + size > current->capacity) {
+    Chunk* next = current ? current->next : first;
+    if (!next || size > next->capacity) {
+      // Too small (or no) chunk is replaced with the new one.
+      size_t capacity = std::max(kChunkSize, size);
+      Chunk* chunk = static_cast<Chunk*>(
+          mallocOrDie(sizeof(Chunk) + kDefaultAlign + capacity));
+      chunk->data = (reinterpret_cast<uintptr_t>(chunk) + sizeof(Chunk) +
+                     kDefaultAlign - 1) & ~(kDefaultAlign - 1);
+      chunk->capacity = capacity;
+      chunk->next = next ? next->next : nullptr;
+      free(next);
+      if (current) {
+        current->next = chunk;
+      } else {
+        first = chunk;
+      }
+      next = chunk;
+    }
+    current = next;
+    used = 0;
+  }
+  void* result = reinterpret_cast<void*>(current->data + used);
+  used += size;
+  return result;
+}
+
+void Arena::reset() {
+  current = nullptr;
+  used = 0;
+}
+
 }  // namespace twim
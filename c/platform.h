@@ -97,6 +97,49 @@ NOINLINE Vector<T>* allocVector(uint32_t capacity) {
   return v;
 }
 
+/*
+ * Bump allocator. Memory is released all at once: on reset (then it is reused)
+ * or on destruction. Allocations are kDefaultAlign-aligned.
+ */
+class Arena {
+ public:
+  Arena() {}
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+  ~Arena();
+
+  void* alloc(size_t size);
+  void reset();
+
+ private:
+  struct Chunk {
+    Chunk* next;
+    uintptr_t data;
+    size_t capacity;
+  };
+  static constexpr size_t kChunkSize = 1u << 20;
+
+  Chunk* first = nullptr;
+  Chunk* current = nullptr;
+  size_t used = 0;
+};
+
+/* Vector that lives in arena; it should not be deleted. */
+template <typename T>
+NOINLINE Vector<T>* allocVector(Arena* arena, uint32_t capacity) {
+  static_assert(sizeof(T) == 4, "sizeot(T) must be 4");
+  using V = Vector<T>;
+  static_assert(sizeof(V) <= kDefaultAlign, "Vector header is too big");
+  const uint32_t vector_capacity = vecSize(capacity);
+  uintptr_t aligned_memory = reinterpret_cast<uintptr_t>(
+      arena->alloc(kDefaultAlign + vector_capacity * sizeof(T))) +
+      kDefaultAlign;
+  V* v = reinterpret_cast<V*>(aligned_memory - sizeof(V));
+  v->offset = 0;
+  v->capacity = vector_capacity;
+  return v;
+}
+
 }  // namespace twim
 
 #endif  // TWIM_PLATFORM
@@ -1,12 +1,24 @@
+#if !defined(__wasm__)
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "region.cc"
+#include "hwy/foreach_target.h"
+#endif  // __wasm__
+
 #include "region.h"
 
+#include <algorithm>
+
 #include "platform.h"
 #include "sin_cos.h"
 
+#include "hwy/highway.h"
+
+HWY_BEFORE_NAMESPACE();
 namespace twim {
+namespace HWY_NAMESPACE {
 
-void Region::splitLine(const Vector<int32_t>& region, int32_t angle, int32_t d,
-                       Vector<int32_t>* left, Vector<int32_t>* right) {
+void splitLine(const Vector<int32_t>& region, int32_t angle, int32_t d,
+               Vector<int32_t>* left, Vector<int32_t>* right) {
   const size_t region_step = region.capacity / 3;
   const size_t region_count = region.len;
   const int32_t* RESTRICT region_y = region.data();
@@ -27,10 +39,39 @@ void Region::splitLine(const Vector<int32_t>& region, int32_t angle, int32_t d,
   int32_t ny = SinCos.kCos[angle];
   uint32_t l_count = 0;
   uint32_t r_count = 0;
+  size_t i = 0;
+
+#if HWY_TARGET != HWY_SCALAR
+  constexpr HWY_FULL(float) df;
+  constexpr HWY_FULL(int32_t) di32;
+  const size_t N = Lanes(di32);
+  // CompressStore might write whole vector; keep enough room in outputs.
+  const auto fits = [&]() {
+    return (i + N <= region_count) && (l_count + N <= left_step) &&
+           (r_count + N <= right_step);
+  };
+#endif
 
   if (nx == 0) {
     // nx = 0 -> ny = SinCos.SCALE -> y * ny ?? d
-    for (size_t i = 0; i < region_count; i++) {
+#if HWY_TARGET != HWY_SCALAR
+    const auto vd = Set(di32, d);
+    const auto vny = Set(di32, ny);
+    for (; fits(); i += N) {
+      const auto y = LoadU(di32, region_y + i);
+      const auto x0 = LoadU(di32, region_x0 + i);
+      const auto x1 = LoadU(di32, region_x1 + i);
+      const auto go_right = (y * vny) < vd;
+      const auto go_left = Not(go_right);
+      CompressStore(y, go_left, di32, left_y + l_count);
+      CompressStore(x0, go_left, di32, left_x0 + l_count);
+      l_count += CompressStore(x1, go_left, di32, left_x1 + l_count);
+      CompressStore(y, go_right, di32, right_y + r_count);
+      CompressStore(x0, go_right, di32, right_x0 + r_count);
+      r_count += CompressStore(x1, go_right, di32, right_x1 + r_count);
+    }
+#endif
+    for (; i < region_count; i++) {
       int32_t y = region_y[i];
       int32_t x0 = region_x0[i];
       int32_t x1 = region_x1[i];
@@ -51,7 +92,49 @@ void Region::splitLine(const Vector<int32_t>& region, int32_t angle, int32_t d,
     d = 2 * d + nx;
     ny = 2 * ny;
     nx = 2 * nx;
-    for (size_t i = 0; i < region_count; i++) {
+#if HWY_TARGET != HWY_SCALAR
+    // Quotient is estimated with reciprocal multiplication and then fixed up
+    // to match truncating integer division exactly. Estimate is clamped to
+    // keep "q * nx" in range; fix-up moves clamped values further outwards,
+    // i.e. beyond any row end, so the comparisons below are not affected.
+    const int32_t q_limit = (1 << 30) / nx;
+    const auto vd = Set(di32, d);
+    const auto vny = Set(di32, ny);
+    const auto vnx = Set(di32, nx);
+    const auto neg_vnx = Set(di32, -nx);
+    const auto inv_nx = Set(df, 1.0f / static_cast<float>(nx));
+    const auto q_min = Set(df, static_cast<float>(-q_limit));
+    const auto q_max = Set(df, static_cast<float>(q_limit));
+    const auto zero = Zero(di32);
+    const auto one = Set(di32, 1);
+    for (; fits(); i += N) {
+      const auto y = LoadU(di32, region_y + i);
+      const auto x0 = LoadU(di32, region_x0 + i);
+      const auto x1 = LoadU(di32, region_x1 + i);
+      const auto num = vd - y * vny;
+      const auto q_est =
+          Min(Max(ConvertTo(df, num) * inv_nx, q_min), q_max);
+      auto x = ConvertTo(di32, q_est);
+      const auto rem = num - x * vnx;
+      const auto is_neg = num < zero;
+      const auto is_pos = Not(is_neg);
+      // num >= 0: 0 <= rem < nx; num < 0: -nx < rem <= 0.
+      const auto dec = Or(And(is_neg, Not(neg_vnx < rem)),
+                          And(is_pos, rem < zero));
+      const auto inc = Or(And(is_neg, rem > zero),
+                          And(is_pos, Not(rem < vnx)));
+      x = IfThenElse(inc, x + one, IfThenElse(dec, x - one, x));
+      const auto go_left = x < x1;
+      const auto go_right = x > x0;
+      CompressStore(y, go_left, di32, left_y + l_count);
+      CompressStore(Max(x, x0), go_left, di32, left_x0 + l_count);
+      l_count += CompressStore(x1, go_left, di32, left_x1 + l_count);
+      CompressStore(y, go_right, di32, right_y + r_count);
+      CompressStore(x0, go_right, di32, right_x0 + r_count);
+      r_count += CompressStore(Min(x, x1), go_right, di32, right_x1 + r_count);
+    }
+#endif
+    for (; i < region_count; i++) {
       int32_t y = region_y[i];
       int32_t x = (d - y * ny) / nx;
       int32_t x0 = region_x0[i];
@@ -74,4 +157,24 @@ void Region::splitLine(const Vector<int32_t>& region, int32_t angle, int32_t d,
   right->len = r_count;
 }
 
+}  // namespace HWY_NAMESPACE
+}  // namespace twim
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace twim {
+
+#if defined(__wasm__)
+#define CALL HWY_STATIC_DISPATCH
+#else
+#define CALL HWY_DYNAMIC_DISPATCH
+HWY_EXPORT(splitLine);
+#endif  // __wasm__
+
+void Region::splitLine(const Vector<int32_t>& region, int32_t angle, int32_t d,
+                       Vector<int32_t>* left, Vector<int32_t>* right) {
+  return CALL(splitLine)(region, angle, d, left, right);
+}
+
 }  // namespace twim
+#endif  // HWY_ONCE
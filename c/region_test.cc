@@ -1,5 +1,7 @@
 #include "region.h"
 
+#include <algorithm>
+
 #include "codec_params.h"
 #include "distance_range.h"
 #include "gtest/gtest.h"
@@ -115,4 +117,62 @@ TEST(RegionTest, VerticalSplit) {
   delete region;
 }
 
+TEST(RegionTest, SplitMatchesDivision) {
+  constexpr uint32_t kWidth = 2048;
+  constexpr uint32_t kHeight = 37;
+  CodecParams cp(kWidth, kHeight);
+  cp.setPartitionCode(0);
+  uint32_t step = vecSize(kHeight);
+  Vector<int32_t>* region = allocVector<int32_t>(3 * step);
+  Vector<int32_t>* left = allocVector<int32_t>(3 * step);
+  Vector<int32_t>* right = allocVector<int32_t>(3 * step);
+  int32_t* RESTRICT y = region->data();
+  uint32_t seed = 42;
+  for (uint32_t i = 0; i < kHeight; ++i) {
+    seed = seed * 1103515245u + 12345u;
+    int32_t a = (seed >> 8) % (kWidth + 1);
+    int32_t b = (seed >> 4) % (kWidth + 1);
+    y[i] = 3 * i;
+    y[step + i] = std::min(a, b);
+    y[2 * step + i] = std::max(a, b) + (a == b ? 1 : 0);
+  }
+  region->len = kHeight;
+
+  for (int32_t angle = 0; angle < SinCos.kMaxAngle; ++angle) {
+    DistanceRange distance_range(*region, angle, cp);
+    for (uint32_t line = 0; line < distance_range.num_lines; ++line) {
+      int32_t d = distance_range.distance(line);
+      Region::splitLine(*region, angle, d, left, right);
+      int32_t nx = SinCos.kSin[angle];
+      int32_t ny = SinCos.kCos[angle];
+      size_t l = 0;
+      size_t r = 0;
+      for (uint32_t i = 0; i < kHeight; ++i) {
+        int32_t x0 = y[step + i];
+        int32_t x1 = y[2 * step + i];
+        int32_t x = (nx == 0) ? ((y[i] * ny >= d) ? x0 : x1)
+                              : ((2 * d + nx - y[i] * 2 * ny) / (2 * nx));
+        if (x < x1) {
+          ASSERT_EQ(y[i], left->data()[l]);
+          ASSERT_EQ(std::max(x, x0), left->data()[step + l]);
+          ASSERT_EQ(x1, left->data()[2 * step + l]);
+          l++;
+        }
+        if (x > x0) {
+          ASSERT_EQ(y[i], right->data()[r]);
+          ASSERT_EQ(x0, right->data()[step + r]);
+          ASSERT_EQ(std::min(x, x1), right->data()[2 * step + r]);
+          r++;
+        }
+      }
+      ASSERT_EQ(l, left->len);
+      ASSERT_EQ(r, right->len);
+    }
+  }
+
+  delete region;
+  delete left;
+  delete right;
+}
+
 }  // namespace twim
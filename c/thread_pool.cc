@@ -0,0 +1,116 @@
+#include "thread_pool.h"
+
+#if !defined(__wasm__)
+
+#include <algorithm>
+#include <utility>
+
+namespace twim {
+
+namespace {
+/* Pool of the current thread; nullptr if it is not a pool thread. */
+thread_local ThreadPool* currentPool = nullptr;
+}  // namespace
+
+ThreadPool::ThreadPool(uint32_t numThreads) : numTarget(numThreads) {
+  threads.reserve(numThreads);
+  for (uint32_t i = 0; i < numThreads; ++i) {
+    threads.emplace_back(&ThreadPool::work, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  wake.notify_all();
+  for (std::thread& thread : threads) thread.join();
+}
+
+ThreadPool* ThreadPool::shared() {
+  // Never destroyed: groups could still be waited for at exit.
+  static ThreadPool* pool =
+      new ThreadPool(std::max(1u, std::thread::hardware_concurrency()));
+  return pool;
+}
+
+void ThreadPool::work() {
+  currentPool = this;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    numIdle++;
+    wake.wait(lock, [this] {
+      return stop || (!ready.empty() && numRunning < numTarget);
+    });
+    numIdle--;
+    if (stop) break;
+    if (next >= ready.size()) next = 0;
+    TaskGroup* group = ready[next];
+    std::function<void()> job = group->take();
+    // take() drops the drained group from |ready|; otherwise move on.
+    if (next < ready.size() && ready[next] == group) next++;
+    numRunning++;
+    lock.unlock();
+    job();
+    lock.lock();
+    numRunning--;
+    if (--group->numUnfinished == 0) group->finished.notify_all();
+  }
+}
+
+void ThreadPool::addRunner() {
+  if (stop || ready.empty() || numRunning >= numTarget) return;
+  if (numIdle > 0) {
+    wake.notify_one();
+  } else {
+    threads.emplace_back(&ThreadPool::work, this);
+  }
+}
+
+std::function<void()> TaskGroup::take() {
+  std::function<void()> job = std::move(queue.front());
+  queue.pop_front();
+  if (queue.empty()) {
+    std::vector<TaskGroup*>& ready = pool->ready;
+    size_t i = std::find(ready.begin(), ready.end(), this) - ready.begin();
+    ready.erase(ready.begin() + i);
+    if (i < pool->next) pool->next--;
+  }
+  return job;
+}
+
+void TaskGroup::spawn(std::function<void()> job) {
+  std::lock_guard<std::mutex> lock(pool->mutex);
+  if (queue.empty()) pool->ready.push_back(this);
+  queue.push_back(std::move(job));
+  numUnfinished++;
+  pool->addRunner();
+}
+
+void TaskGroup::wait() {
+  // Pool thread that is blocked here does not count as running.
+  bool isPoolThread = (currentPool == pool);
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  while (numUnfinished > 0) {
+    if (queue.empty()) {
+      if (isPoolThread) {
+        pool->numRunning--;
+        pool->addRunner();
+      }
+      finished.wait(lock);
+      if (isPoolThread) pool->numRunning++;
+      continue;
+    }
+    std::function<void()> job = take();
+    lock.unlock();
+    job();
+    lock.lock();
+    // Other threads could wait for the group as well.
+    if (--numUnfinished == 0) finished.notify_all();
+  }
+}
+
+}  // namespace twim
+
+#endif  // !defined(__wasm__)
@@ -0,0 +1,101 @@
+#ifndef TWIM_THREAD_POOL
+#define TWIM_THREAD_POOL
+
+#if !defined(__wasm__)
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "platform.h"
+
+namespace twim {
+
+class TaskGroup;
+
+/*
+ * Fixed set of threads that run jobs of task groups.
+ *
+ * All the jobs are queued under a single lock; there are no per-thread
+ * queues. Idle threads take jobs from the groups that have some, one group
+ * after another. A running job holds its thread until it returns, so
+ * concurrent groups (e.g. separate encode requests) take turns only if jobs
+ * are short: long work should be done as a job that re-queues itself, and
+ * jobs should not wait for anything but the groups they spawn.
+ *
+ * Job that waits for a group gives up its thread: while it is blocked,
+ * another thread (an idle one, or a new one if there is none) takes the
+ * queued jobs, so that numThreads jobs keep running. Threads are not stopped
+ * until the pool is destroyed.
+ */
+class ThreadPool {
+ public:
+  explicit ThreadPool(uint32_t numThreads);
+  ~ThreadPool();
+
+  /* Process-wide pool; created on the first use with a thread per core. */
+  static ThreadPool* shared();
+
+  uint32_t numThreads() const { return numTarget; }
+
+ private:
+  friend class TaskGroup;
+
+  void work();
+  /* Lets one more thread run the queued jobs, unless numThreads jobs are
+     running already; called with the lock held. */
+  void addRunner();
+
+  const uint32_t numTarget;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stop = false;
+  /* Threads that run jobs, except those blocked in TaskGroup::wait. */
+  uint32_t numRunning = 0;
+  /* Threads that wait for jobs. */
+  uint32_t numIdle = 0;
+  /* Groups with queued jobs; |next| is the one to take the next job from. */
+  std::vector<TaskGroup*> ready;
+  size_t next = 0;
+  std::vector<std::thread> threads;
+};
+
+/*
+ * Fork-join set of jobs run by the pool.
+ *
+ * wait() runs the jobs no thread has taken yet in the calling thread, so it
+ * never waits for a free pool thread; groups could be nested and could wait
+ * from within the pool jobs. Several threads could wait for the same group.
+ */
+class TaskGroup {
+ public:
+  explicit TaskGroup(ThreadPool* pool = ThreadPool::shared()) : pool(pool) {}
+  /* Waits for the jobs. */
+  ~TaskGroup() { wait(); }
+
+  /* Queues |job|; could be called by the jobs of the group, as well. */
+  void spawn(std::function<void()> job);
+  /* Returns when all the spawned jobs are done. */
+  void wait();
+
+ private:
+  friend class ThreadPool;
+
+  /* Takes the next queued job; called with the pool lock held. */
+  std::function<void()> take();
+
+  ThreadPool* pool;
+  std::deque<std::function<void()>> queue;
+  /* Queued and running jobs. */
+  size_t numUnfinished = 0;
+  std::condition_variable finished;
+};
+
+}  // namespace twim
+
+#endif  // !defined(__wasm__)
+
+#endif  // TWIM_THREAD_POOL
@@ -0,0 +1,95 @@
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace twim {
+
+TEST(ThreadPoolTest, NestedGroupsFinish) {
+  ThreadPool pool(2);
+  std::atomic<uint32_t> count{0};
+  TaskGroup outer(&pool);
+  for (uint32_t i = 0; i < 8; ++i) {
+    outer.spawn([&pool, &count] {
+      // Waits from the pool thread; unstarted jobs are run inline.
+      TaskGroup inner(&pool);
+      for (uint32_t j = 0; j < 8; ++j) inner.spawn([&count] { count++; });
+      inner.wait();
+    });
+  }
+  outer.wait();
+  EXPECT_EQ(64u, count.load());
+}
+
+TEST(ThreadPoolTest, GroupsTakeTurns) {
+  ThreadPool pool(1);
+  std::vector<uint32_t> order;
+  std::atomic<uint32_t> numDone{0};
+  std::atomic<bool> started{false};
+  std::atomic<bool> blocked{true};
+  // The only thread is kept busy until both groups are queued.
+  TaskGroup gate(&pool);
+  gate.spawn([&started, &blocked] {
+    started = true;
+    while (blocked) std::this_thread::yield();
+  });
+  while (!started) std::this_thread::yield();
+  TaskGroup first(&pool);
+  TaskGroup second(&pool);
+  for (uint32_t i = 0; i < 3; ++i) {
+    first.spawn([&] { order.push_back(1); numDone++; });
+  }
+  for (uint32_t i = 0; i < 3; ++i) {
+    second.spawn([&] { order.push_back(2); numDone++; });
+  }
+  blocked = false;
+  while (numDone < 6) std::this_thread::yield();
+  EXPECT_EQ((std::vector<uint32_t>{1, 2, 1, 2, 1, 2}), order);
+}
+
+TEST(ThreadPoolTest, BlockedJobGivesUpItsThread) {
+  ThreadPool pool(1);
+  std::atomic<bool> started{false};
+  std::atomic<bool> blocked{true};
+  std::atomic<bool> go{false};
+  std::atomic<bool> waited{false};
+  // The only thread is kept busy until all the jobs are queued.
+  TaskGroup gate(&pool);
+  gate.spawn([&started, &blocked] {
+    started = true;
+    while (blocked) std::this_thread::yield();
+  });
+  while (!started) std::this_thread::yield();
+  // Slow job is run by a thread outside of the pool, until |go|.
+  TaskGroup slow(&pool);
+  std::atomic<bool> slowStarted{false};
+  slow.spawn([&slowStarted, &go] {
+    slowStarted = true;
+    while (!go) std::this_thread::yield();
+  });
+  std::thread helper([&slow] { slow.wait(); });
+  while (!slowStarted) std::this_thread::yield();
+  // The first job blocks the pool thread; the second one should still run.
+  TaskGroup jobs(&pool);
+  jobs.spawn([&slow, &waited] {
+    slow.wait();
+    waited = true;
+  });
+  jobs.spawn([&go] { go = true; });
+  blocked = false;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!waited && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::yield();
+  }
+  EXPECT_TRUE(waited.load());
+  go = true;
+  helper.join();
+  jobs.wait();
+  gate.wait();
+}
+
+}  // namespace twim
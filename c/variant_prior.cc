@@ -0,0 +1,140 @@
+#include "variant_prior.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+
+#include "codec_params.h"
+
+namespace twim {
+
+namespace {
+
+uint32_t bitLength(uint32_t value) {
+  uint32_t result = 0;
+  while (value != 0) {
+    result++;
+    value >>= 1;
+  }
+  return result;
+}
+
+}  // namespace
+
+std::string VariantPrior::classify(const Image& image) {
+  const uint32_t width = image.width;
+  const uint32_t height = image.height;
+  // Colors are counted with 4 bits per channel.
+  std::vector<bool> seen(1 << 12, false);
+  uint32_t num_colors = 0;
+  // Neighbours that differ noticeably.
+  constexpr int32_t kEdgeThreshold = 48;
+  uint64_t num_edges = 0;
+  uint64_t num_pairs = 0;
+  for (uint32_t y = 0; y < height; ++y) {
+    for (uint32_t x = 0; x < width; ++x) {
+      size_t offset = y * width + x;
+      uint32_t color = ((image.r[offset] >> 4) << 8) |
+                       ((image.g[offset] >> 4) << 4) | (image.b[offset] >> 4);
+      if (!seen[color]) {
+        seen[color] = true;
+        num_colors++;
+      }
+      size_t neighbours[2] = {offset + 1, offset + width};
+      bool valid[2] = {x + 1 < width, y + 1 < height};
+      for (size_t i = 0; i < 2; ++i) {
+        if (!valid[i]) continue;
+        size_t other = neighbours[i];
+        int32_t d = std::abs(image.r[offset] - image.r[other]) +
+                    std::abs(image.g[offset] - image.g[other]) +
+                    std::abs(image.b[offset] - image.b[other]);
+        num_pairs++;
+        if (d > kEdgeThreshold) num_edges++;
+      }
+    }
+  }
+  uint32_t edge_class = 0;
+  if (num_pairs > 0) {
+    edge_class = static_cast<uint32_t>(
+        std::min<uint64_t>(7, 16 * num_edges / num_pairs));
+  }
+  std::stringstream out;
+  out << "s" << bitLength(std::max(width, height)) << "c"
+      << bitLength(num_colors) << "e" << edge_class;
+  return out.str();
+}
+
+void VariantPrior::addWin(const std::string& group,
+                          const Encoder::Variant& variant) {
+  wins[group][key(variant)]++;
+}
+
+bool VariantPrior::parse(const std::string& text) {
+  std::istringstream in(text);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    char group[64];
+    uint32_t partitionCode;
+    uint32_t lineLimit;
+    uint32_t count;
+    if (std::sscanf(line.c_str(), "%63s %x:%x %x", group, &partitionCode,
+                    &lineLimit, &count) != 4) {
+      return false;
+    }
+    if (partitionCode >= CodecParams::kMaxPartitionCode) return false;
+    if (lineLimit >= CodecParams::kMaxLineLimit) return false;
+    Encoder::Variant variant;
+    variant.partitionCode = partitionCode;
+    variant.lineLimit = lineLimit;
+    wins[group][key(variant)] += count;
+  }
+  return true;
+}
+
+std::string VariantPrior::serialize() const {
+  std::stringstream out;
+  out << std::hex << std::uppercase;
+  for (const auto& group : wins) {
+    for (const auto& entry : group.second) {
+      out << group.first << " " << (entry.first >> 6) << ":"
+          << (entry.first & 63) << " " << entry.second << "\n";
+    }
+  }
+  return out.str();
+}
+
+void VariantPrior::rank(const std::string& group,
+                        std::vector<Encoder::Variant>* variants,
+                        std::vector<float>* weights) const {
+  std::map<uint32_t, uint32_t> counts;
+  auto it = wins.find(group);
+  if (it != wins.end()) {
+    counts = it->second;
+  } else {
+    for (const auto& other : wins) {
+      for (const auto& entry : other.second) {
+        counts[entry.first] += entry.second;
+      }
+    }
+  }
+  auto winsOf = [&](const Encoder::Variant& variant) -> uint32_t {
+    auto found = counts.find(key(variant));
+    return (found == counts.end()) ? 0 : found->second;
+  };
+  std::stable_sort(variants->begin(), variants->end(),
+                   [&](const Encoder::Variant& l, const Encoder::Variant& r) {
+                     return winsOf(l) > winsOf(r);
+                   });
+  uint64_t total = 0;
+  for (const auto& entry : counts) total += entry.second;
+  weights->resize(variants->size());
+  for (size_t i = 0; i < variants->size(); ++i) {
+    (*weights)[i] =
+        (total > 0) ? static_cast<float>(winsOf(variants->at(i))) / total
+                    : 0.0f;
+  }
+}
+
+}  // namespace twim
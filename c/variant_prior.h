@@ -0,0 +1,55 @@
+#ifndef TWIM_VARIANT_PRIOR
+#define TWIM_VARIANT_PRIOR
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "encoder.h"
+#include "image.h"
+#include "platform.h"
+
+namespace twim {
+
+/*
+ * Statistics of variants that won on a corpus of images, grouped by cheap
+ * image features. Used to simulate the likely winners first; see
+ * Encoder::Params::patience.
+ */
+class VariantPrior {
+ public:
+  /*
+   * Returns the name of the group of similar images: classes of the longer
+   * side, of the number of distinct colors and of the edge density.
+   */
+  static std::string classify(const Image& image);
+
+  void addWin(const std::string& group, const Encoder::Variant& variant);
+
+  /*
+   * Text form: "GROUP PARTITION_CODE:LINE_LIMIT WINS" line per entry; numbers
+   * are hexadecimal, as in "-p" CLI option, but line limit is not a bitfield.
+   */
+  bool parse(const std::string& text);
+  std::string serialize() const;
+
+  /*
+   * Stable-sorts |variants| by the number of wins in the |group|, most
+   * winning first; if the group is unknown, wins of all the groups are
+   * used. Fills |weights| with the shares of the wins.
+   */
+  void rank(const std::string& group, std::vector<Encoder::Variant>* variants,
+            std::vector<float>* weights) const;
+
+ private:
+  static uint32_t key(const Encoder::Variant& variant) {
+    return (variant.partitionCode << 6) | variant.lineLimit;
+  }
+
+  /* group -> key -> wins */
+  std::map<std::string, std::map<uint32_t, uint32_t>> wins;
+};
+
+}  // namespace twim
+
+#endif  // TWIM_VARIANT_PRIOR
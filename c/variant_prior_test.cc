@@ -0,0 +1,68 @@
+#include "variant_prior.h"
+
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace twim {
+
+using ::twim::Encoder::Variant;
+
+namespace {
+Variant makeVariant(uint32_t partitionCode, uint32_t lineLimit) {
+  Variant result;
+  result.partitionCode = partitionCode;
+  result.lineLimit = lineLimit;
+  result.colorOptions = 1;
+  return result;
+}
+}  // namespace
+
+TEST(VariantPriorTest, Classify) {
+  // 300x20 stripes of 2 colors: every vertical pair is an edge.
+  std::vector<uint32_t> tmp(300 * 20);
+  for (size_t y = 0; y < 20; ++y) {
+    for (size_t x = 0; x < 300; ++x) {
+      tmp[y * 300 + x] = (y & 1) ? 0xFFFFFFFF : 0xFF000000;
+    }
+  }
+  Image image =
+      Image::fromRgba(reinterpret_cast<uint8_t*>(tmp.data()), 300, 20);
+  EXPECT_EQ("s9c2e7", VariantPrior::classify(image));
+}
+
+TEST(VariantPriorTest, RankAndSerialize) {
+  VariantPrior prior;
+  prior.addWin("a", makeVariant(0x1F3, 2));
+  prior.addWin("a", makeVariant(0x1F3, 2));
+  prior.addWin("a", makeVariant(0xD7, 40));
+  prior.addWin("b", makeVariant(0x3, 0));
+  prior.addWin("b", makeVariant(0x3, 0));
+  prior.addWin("b", makeVariant(0x3, 0));
+
+  VariantPrior copy;
+  ASSERT_TRUE(copy.parse(prior.serialize()));
+  EXPECT_EQ(prior.serialize(), copy.serialize());
+  EXPECT_FALSE(copy.parse("a 1F4:0 1\n"));
+
+  std::vector<Variant> variants = {makeVariant(0x3, 0), makeVariant(0xD7, 40),
+                                   makeVariant(0x55, 1),
+                                   makeVariant(0x1F3, 2)};
+  std::vector<float> weights;
+  copy.rank("a", &variants, &weights);
+  EXPECT_EQ(0x1F3u, variants[0].partitionCode);
+  EXPECT_EQ(0xD7u, variants[1].partitionCode);
+  // Stable for the rest.
+  EXPECT_EQ(0x3u, variants[2].partitionCode);
+  EXPECT_EQ(0x55u, variants[3].partitionCode);
+  EXPECT_FLOAT_EQ(2.0f / 3.0f, weights[0]);
+  EXPECT_FLOAT_EQ(1.0f / 3.0f, weights[1]);
+  EXPECT_EQ(0.0f, weights[2]);
+
+  // Unknown group: all the wins are counted.
+  copy.rank("c", &variants, &weights);
+  EXPECT_EQ(0x3u, variants[0].partitionCode);
+  EXPECT_FLOAT_EQ(0.5f, weights[0]);
+}
+
+}  // namespace twim